@@ -0,0 +1,138 @@
+/* arena.c : bump allocator that owns everything built during a parse. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "mem.h"
+
+#define ARENA_BLOCK_SIZE 65536 /* default size of a block's data area */
+
+union arena_align {
+	long l;
+	long long ll;
+	double d;
+	void *p;
+};
+
+#define ARENA_ALIGN sizeof(union arena_align)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size; /* bytes available in data[] */
+	size_t used;
+	union arena_align data[];
+};
+
+/* blocks are never returned to the system until arena_free(), a reset only
+ * rewinds to the first block so the next parse can reuse all of them. */
+struct arena {
+	struct arena_block *head;
+	struct arena_block *cur;
+};
+
+static struct arena_block *block_new(size_t size)
+{
+	struct arena_block *b;
+
+	if (size < ARENA_BLOCK_SIZE)
+		size = ARENA_BLOCK_SIZE;
+	b = mem_alloc(sizeof(*b) + size);
+	if (!b)
+		return NULL;
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+struct arena *arena_new(void)
+{
+	struct arena *a;
+
+	a = mem_calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	a->head = a->cur = block_new(0);
+	if (!a->head) {
+		mem_free(a);
+		return NULL;
+	}
+	return a;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	if (!a)
+		return;
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		mem_free(b);
+	}
+	mem_free(a);
+}
+
+/* release everything allocated from the arena in one step. */
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b;
+
+	for (b = a->head; b; b = b->next)
+		b->used = 0;
+	a->cur = a->head;
+}
+
+/* returns zero filled memory, like calloc(). */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_block *b = a->cur;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	while (b->size - b->used < size) {
+		if (!b->next || b->next->size < size) {
+			/* insert a fresh block after the current one */
+			struct arena_block *n = block_new(size);
+
+			if (!n)
+				return NULL;
+			n->next = b->next;
+			b->next = n;
+		}
+		b = b->next;
+		a->cur = b;
+	}
+	p = (char*)b->data + b->used;
+	b->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char *p;
+
+	p = arena_alloc(a, len + 1);
+	if (!p)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = 0;
+	return p;
+}
@@ -0,0 +1,11 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+struct arena;
+
+struct arena *arena_new(void);
+void arena_free(struct arena *a);
+void arena_reset(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+#endif
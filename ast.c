@@ -17,17 +17,27 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "arena.h"
 #include "ast.h"
 #include "tok.h"
+#include "stats.h"
+#include "mem.h"
 
 ast_node ast_node_new(struct pstate *st, enum ast_type type)
 {
 	ast_node n;
-	n = calloc(1, sizeof(*n));
+	n = arena_alloc(pstate_arena(st), sizeof(*n));
+	if (!n) {
+		error(st, "out of memory");
+		return NULL;
+	}
 	n->type = type;
 	n->op = ~0;
-	n->line = line_cur(st);
+	n->line = tok_line(st);
+	n->ofs = tok_ofs(st);
+	STATS_ADD(nodes, 1);
 	return n;
 }
 
@@ -43,56 +53,271 @@ static const char *opname(enum ast_op op)
 	return "UNKNOWN";
 }
 
-void ast_node_dump(const ast_node n)
+/* the i'th child of n, in evaluation order, or NULL past the last one */
+ast_node *ast_child(ast_node n, unsigned i)
 {
-	if (!n)
-		return;
-
 	switch (n->type) {
 	case N_2OP:
-		printf(" (%s", opname(n->op));
-		ast_node_dump(n->left);
-		ast_node_dump(n->right);
-		printf(")");
-		return;
+		return i == 0 ? &n->left : i == 1 ? &n->right : NULL;
+	case N_COND:
+		return i == 0 ? &n->left : i < 3 ? &n->arg[i - 1] : NULL;
 	case N_NUM:
-		printf(" %ld", n->num);
-		return;
 	case N_VAR:
-		printf(" %s", n->id);
-		return;
-	case N_COND:
-		printf(" (if");
-		ast_node_dump(n->left); /* condition */
-		ast_node_dump(n->arg[0]); /* true case */
-		ast_node_dump(n->arg[1]); /* false case */
-		printf(")");
-		return;
+		break;
 	}
-
-	printf("ERROR\n");
+	return NULL;
 }
 
-void ast_node_free(ast_node n)
+/* expressions have no side effects, so nodes that compute the same thing
+ * from the same children are interchangeable. children are shared before
+ * their parents, which makes comparing their pointers enough. */
+static unsigned cons_hash(ast_node n)
 {
-	if (!n)
-		return;
+	unsigned long long h = 14695981039346656037ull ^ n->type;
+
 	switch (n->type) {
-	case N_2OP:
-		ast_node_free(n->left);
-		ast_node_free(n->right);
-		break;
 	case N_NUM:
+		h = (h ^ (unsigned long)n->num) * 1099511628211ull;
 		break;
 	case N_VAR:
-		free(n->id);
-		n->id = NULL;
+		h = (h ^ n->sym) * 1099511628211ull;
+		break;
+	case N_2OP:
+		h = (h ^ n->op) * 1099511628211ull;
+		h = (h ^ (unsigned long)n->right) * 1099511628211ull;
 		break;
 	case N_COND:
-		ast_node_free(n->left);
-		ast_node_free(n->arg[0]);
-		ast_node_free(n->arg[1]);
+		h = (h ^ (unsigned long)n->arg[0]) * 1099511628211ull;
+		h = (h ^ (unsigned long)n->arg[1]) * 1099511628211ull;
 		break;
 	}
-	free(n);
+	if (n->type == N_2OP || n->type == N_COND)
+		h = (h ^ (unsigned long)n->left) * 1099511628211ull;
+	return h ^ h >> 32;
+}
+
+static int cons_equal(ast_node a, ast_node b)
+{
+	if (a->type != b->type)
+		return 0;
+	switch (a->type) {
+	case N_NUM:
+		return a->num == b->num;
+	case N_VAR:
+		return a->sym == b->sym;
+	case N_2OP:
+		return a->op == b->op && a->left == b->left && a->right == b->right;
+	case N_COND:
+		return a->left == b->left && a->arg[0] == b->arg[0] && a->arg[1] == b->arg[1];
+	}
+	return 0;
+}
+
+void ast_cons_init(struct ast_cons *c)
+{
+	c->slot = NULL;
+	c->n = 0;
+	c->max = 0;
+}
+
+/* returns the node already built that is identical to n, or adds n and
+ * returns it. n's children must have come from here already. the first
+ * node keeps its position, so every use of a shared node reports where the
+ * expression first appeared. when out of memory n is returned unshared. */
+ast_node ast_cons(struct ast_cons *c, ast_node n)
+{
+	unsigned i, h, mask;
+
+	if (!n)
+		return NULL;
+	if ((c->n + 1) * 4 > c->max * 3) {
+		unsigned max = c->max ? c->max * 2 : 256, j;
+		struct ast_cons_slot *slot = mem_calloc(max, sizeof(*slot));
+
+		if (!slot)
+			return n;
+		for (i = 0; i < c->max; i++) {
+			if (!c->slot[i].node)
+				continue;
+			for (j = c->slot[i].hash & (max - 1); slot[j].node; j = (j + 1) & (max - 1))
+				;
+			slot[j] = c->slot[i];
+		}
+		mem_free(c->slot);
+		c->slot = slot;
+		c->max = max;
+	}
+	mask = c->max - 1;
+	h = cons_hash(n);
+	for (i = h & mask; c->slot[i].node; i = (i + 1) & mask) {
+		if (c->slot[i].hash == h && cons_equal(c->slot[i].node, n)) {
+			STATS_ADD(shared, 1);
+			return c->slot[i].node;
+		}
+	}
+	c->slot[i].node = n;
+	c->slot[i].hash = h;
+	c->n++;
+	return n;
+}
+
+void ast_cons_free(struct ast_cons *c)
+{
+	mem_free(c->slot);
+	ast_cons_init(c);
+}
+
+void ast_map_init(struct ast_map *m)
+{
+	m->slot = NULL;
+	m->n = 0;
+	m->max = 0;
+}
+
+static unsigned map_hash(ast_node n)
+{
+	unsigned long long h = (unsigned long)n * 0x9e3779b97f4a7c15ull;
+
+	return h >> 32;
+}
+
+/* stores val for n, replacing any it had. returns 0 if out of memory. */
+int ast_map_set(struct ast_map *m, ast_node n, unsigned val)
+{
+	unsigned i, mask;
+
+	if ((m->n + 1) * 4 > m->max * 3) {
+		unsigned max = m->max ? m->max * 2 : 256, j;
+		struct ast_map_slot *slot = mem_calloc(max, sizeof(*slot));
+
+		if (!slot)
+			return 0;
+		for (i = 0; i < m->max; i++) {
+			if (!m->slot[i].node)
+				continue;
+			for (j = map_hash(m->slot[i].node) & (max - 1); slot[j].node; j = (j + 1) & (max - 1))
+				;
+			slot[j] = m->slot[i];
+		}
+		mem_free(m->slot);
+		m->slot = slot;
+		m->max = max;
+	}
+	mask = m->max - 1;
+	for (i = map_hash(n) & mask; m->slot[i].node; i = (i + 1) & mask) {
+		if (m->slot[i].node == n) {
+			m->slot[i].val = val;
+			return 1;
+		}
+	}
+	m->slot[i].node = n;
+	m->slot[i].val = val;
+	m->n++;
+	return 1;
+}
+
+/* the value stored for n, ~0u if there is none */
+unsigned ast_map_get(const struct ast_map *m, ast_node n)
+{
+	unsigned i, mask = m->max - 1;
+
+	if (!m->max)
+		return ~0u;
+	for (i = map_hash(n) & mask; m->slot[i].node; i = (i + 1) & mask) {
+		if (m->slot[i].node == n)
+			return m->slot[i].val;
+	}
+	return ~0u;
+}
+
+void ast_map_free(struct ast_map *m)
+{
+	mem_free(m->slot);
+	ast_map_init(m);
+}
+
+void ast_node_dump(const ast_node root)
+{
+	struct ast_stack s;
+	struct ast_frame *f;
+	ast_node n, *child;
+
+	ast_stack_init(&s);
+	if (root && !ast_push(&s, root, 0))
+		printf(" ERROR");
+	while (s.n) {
+		f = &s.frame[s.n - 1];
+		n = f->node;
+		if (!f->step) {
+			switch (n->type) {
+			case N_2OP:
+				printf(" (%s", opname(n->op));
+				break;
+			case N_NUM:
+				printf(" %ld", n->num);
+				break;
+			case N_VAR:
+				printf(" %s", n->id);
+				break;
+			case N_COND:
+				printf(" (if");
+				break;
+			}
+		}
+		child = ast_child(n, f->step++);
+		if (child) {
+			if (*child && !ast_push(&s, *child, 0)) {
+				printf(" ERROR");
+				break;
+			}
+			continue;
+		}
+		if (n->type == N_2OP || n->type == N_COND)
+			printf(")");
+		s.n--;
+	}
+	ast_stack_free(&s);
+}
+
+void ast_stack_init(struct ast_stack *s)
+{
+	s->frame = s->small;
+	s->n = 0;
+	s->max = sizeof(s->small) / sizeof(*s->small);
+}
+
+/* returns the new top frame, or NULL if out of memory. the frames may move,
+ * pointers to them are only good until the next push. */
+struct ast_frame *ast_push(struct ast_stack *s, ast_node node, unsigned step)
+{
+	struct ast_frame *f;
+
+	if (s->n == s->max) {
+		unsigned max = s->max * 2;
+
+		if (s->frame == s->small) {
+			f = mem_alloc(sizeof(*f) * max);
+			if (f)
+				memcpy(f, s->small, sizeof(s->small));
+		} else {
+			f = mem_realloc(s->frame, sizeof(*f) * max);
+		}
+		if (!f)
+			return NULL;
+		s->frame = f;
+		s->max = max;
+	}
+	f = &s->frame[s->n++];
+	f->node = node;
+	f->slot = NULL;
+	f->step = step;
+	f->mark = 0;
+	return f;
+}
+
+void ast_stack_free(struct ast_stack *s)
+{
+	if (s->frame != s->small)
+		mem_free(s->frame);
+	ast_stack_init(s);
 }
@@ -15,7 +15,9 @@ enum ast_op {
 	O_ADD, O_SUB, O_MUL, O_DIV,
 };
 
-/* TODO: make this structure opaque. */
+/* TODO: make this structure opaque.
+ * nodes live in the arena of the pstate that built them, they are released
+ * all at once by arena_reset() or arena_free(). */
 struct ast_node {
 	enum ast_type type;
 	ast_node left;
@@ -25,14 +27,66 @@ struct ast_node {
 			enum ast_op op;
 		};
 		long num; /* N_NUM */
-		char *id; /* N_VAR */
+		struct {
+			const char *id; /* N_VAR, interned name */
+			unsigned sym; /* N_VAR, dense symbol index */
+		};
 		ast_node arg[2]; /* N_COND */
 	};
-	/* useful for error reporting during compile stage */
+	/* where the node's token starts, for errors and the line table */
 	unsigned line;
+	unsigned ofs;
+};
+
+/* the nodes built so far, for sharing structurally identical subtrees */
+struct ast_cons {
+	struct ast_cons_slot {
+		ast_node node;
+		unsigned hash; /* saves looking at the node */
+	} *slot;
+	unsigned n;
+	unsigned max;
+};
+
+/* a number for each node, the state a walk keeps per node lives here
+ * instead of in the nodes */
+struct ast_map {
+	struct ast_map_slot {
+		ast_node node;
+		unsigned val;
+	} *slot;
+	unsigned n;
+	unsigned max;
+};
+
+/* a node and how far a walk has got through it */
+struct ast_frame {
+	ast_node node;
+	ast_node *slot; /* where the walk stores the node's replacement */
+	unsigned step;
+	unsigned mark; /* for the walker's own use */
+};
+
+/* explicit stack for walking trees of any depth without recursion. the first
+ * frames live in the structure itself, shallow trees need no allocation. */
+struct ast_stack {
+	struct ast_frame *frame;
+	unsigned n;
+	unsigned max;
+	struct ast_frame small[32];
 };
 
 ast_node ast_node_new(struct pstate *st, enum ast_type type);
+ast_node *ast_child(ast_node n, unsigned i);
+void ast_cons_init(struct ast_cons *c);
+ast_node ast_cons(struct ast_cons *c, ast_node n);
+void ast_cons_free(struct ast_cons *c);
+void ast_map_init(struct ast_map *m);
+int ast_map_set(struct ast_map *m, ast_node n, unsigned val);
+unsigned ast_map_get(const struct ast_map *m, ast_node n);
+void ast_map_free(struct ast_map *m);
 void ast_node_dump(const ast_node n);
-void ast_node_free(ast_node n);
+void ast_stack_init(struct ast_stack *s);
+struct ast_frame *ast_push(struct ast_stack *s, ast_node node, unsigned step);
+void ast_stack_free(struct ast_stack *s);
 #endif
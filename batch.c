@@ -0,0 +1,402 @@
+/* batch.c : runs one program over many sets of globals at once. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Global i of row r is column[i][r]. Rows are processed BATCH_LANES at a
+ * time: every stack entry is a vector with one lane per row, so each
+ * instruction is dispatched once per block and its work is a plain loop over
+ * the lanes that the compiler turns into SIMD code.
+ *
+ * A conditional jump is taken for the whole block when all lanes agree. A
+ * block whose lanes disagree, or a program that stores to globals, is run one
+ * row at a time with the scalar VM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "batch.h"
+#include "pool.h"
+#include "trace.h"
+
+#define BATCH_LANES 256
+#define BATCH_CHUNK (BATCH_LANES * 64) /* rows handed to a thread at a time */
+
+struct binsn {
+	enum vmop op;
+	vmcell arg;
+	unsigned target; /* instruction number of a jump's destination */
+};
+
+struct batch {
+	struct binsn *insn;
+	unsigned n;
+	int max_stack;
+	int scalar; /* always run row by row */
+	const unsigned char *code;
+	unsigned code_len;
+	unsigned nglobals;
+};
+
+typedef vmcell lanes[BATCH_LANES];
+
+/* code must be preserved until batch_free(). */
+struct batch *batch_new(const unsigned char *code, unsigned code_len, unsigned nglobals)
+{
+	struct batch *b;
+	unsigned *index = NULL, pc, i;
+	struct vminsn insn;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+	b->code = code;
+	b->code_len = code_len;
+	b->nglobals = nglobals;
+	b->max_stack = vm_verify(code, code_len, nglobals, NULL);
+	if (b->max_stack < 1)
+		goto fail;
+	b->insn = malloc(sizeof(*b->insn) * code_len);
+	index = malloc(sizeof(*index) * code_len);
+	if (!b->insn || !index)
+		goto fail;
+	for (pc = 0; pc < code_len; pc += insn.len) {
+		if (!vm_decode(code, code_len, pc, &insn))
+			goto fail;
+		index[pc] = b->n;
+		b->insn[b->n].op = insn.op;
+		b->insn[b->n].arg = insn.arg;
+		b->insn[b->n].target = insn.target;
+		if (insn.op == ISTORE)
+			b->scalar = 1;
+		b->n++;
+	}
+	/* vm_verify() already checked that every target is an instruction */
+	for (i = 0; i < b->n; i++) {
+		enum vmop op = b->insn[i].op;
+
+		if (op == JZ || op == JNZ || op == JMP)
+			b->insn[i].target = index[b->insn[i].target];
+	}
+	free(index);
+	return b;
+fail:
+	free(index);
+	batch_free(b);
+	return NULL;
+}
+
+void batch_free(struct batch *b)
+{
+	if (!b)
+		return;
+	free(b->insn);
+	free(b);
+}
+
+static const vmcell *column_at(const vmcell *const *column, unsigned ncolumns,
+	vmcell i, size_t row)
+{
+	return i < ncolumns && column[i] ? column[i] + row : NULL;
+}
+
+/* returns 0 if the lanes disagree on a branch. */
+static int run_block(const struct batch *b, lanes *stack,
+	const vmcell *const *column, unsigned ncolumns,
+	vmcell *out, size_t row, unsigned n)
+{
+	unsigned i = 0, l;
+	lanes *const base = stack + 2; /* keeps sp[-2] inside the allocation */
+	lanes *sp = base;
+
+	while (1) {
+		const struct binsn *in = &b->insn[i++];
+		vmcell *restrict x = sp[-1], *restrict y = sp[-2];
+		const vmcell *g;
+
+		switch (in->op) {
+		case HALT:
+			memcpy(out + row, x, n * sizeof(*out));
+			return 1;
+		case IFETCH:
+			g = column_at(column, ncolumns, in->arg, row);
+			if (g)
+				memcpy(sp[0], g, n * sizeof(vmcell));
+			else
+				memset(sp[0], 0, n * sizeof(vmcell));
+			sp++;
+			break;
+		case ISTORE: /* batch_new() marks these programs scalar */
+			return 0;
+		case IPUSH:
+			for (l = 0; l < n; l++)
+				sp[0][l] = in->arg;
+			sp++;
+			break;
+		case IPOP:
+			sp--;
+			break;
+		case IADD:
+			for (l = 0; l < n; l++)
+				y[l] += x[l];
+			sp--;
+			break;
+		case ISUB:
+			for (l = 0; l < n; l++)
+				y[l] -= x[l];
+			sp--;
+			break;
+		case UMUL:
+			for (l = 0; l < n; l++)
+				y[l] *= x[l];
+			sp--;
+			break;
+		case UDIV:
+			for (l = 0; l < n; l++)
+				y[l] = x[l] ? y[l] / x[l] : y[l];
+			sp--;
+			break;
+		case ILT:
+			for (l = 0; l < n; l++)
+				y[l] = y[l] < x[l];
+			sp--;
+			break;
+		case JZ:
+		case JNZ: {
+			unsigned nz = 0;
+
+			for (l = 0; l < n; l++)
+				nz += x[l] != 0;
+			if (nz != 0 && nz != n)
+				return 0;
+			sp--;
+			if ((in->op == JZ) == (nz == 0))
+				i = in->target;
+			break;
+		}
+		case JMP:
+			i = in->target;
+			break;
+		case IADDI:
+			for (l = 0; l < n; l++)
+				x[l] += in->arg;
+			break;
+		case ISUBI:
+			for (l = 0; l < n; l++)
+				x[l] -= in->arg;
+			break;
+		case UMULI:
+			for (l = 0; l < n; l++)
+				x[l] *= in->arg;
+			break;
+		case UDIVI:
+			if (in->arg)
+				for (l = 0; l < n; l++)
+					x[l] /= in->arg;
+			break;
+		case IDUP:
+			memcpy(sp[0], x, n * sizeof(vmcell));
+			sp++;
+			break;
+		case TALLOC:
+			for (l = 0; l < in->arg; l++)
+				memset(sp[l], 0, n * sizeof(vmcell));
+			sp += in->arg;
+			break;
+		case TSTORE:
+			memmove(base[in->arg], x, n * sizeof(vmcell));
+			break;
+		case TFETCH:
+			memmove(sp[0], base[in->arg], n * sizeof(vmcell));
+			sp++;
+			break;
+		case SELECT: {
+			vmcell *restrict c = sp[-3];
+
+			/* both values are there, so the lanes may disagree */
+			for (l = 0; l < n; l++)
+				c[l] = c[l] ? y[l] : x[l];
+			sp -= 2;
+			break;
+		}
+		case IADDG:
+		case ISUBG:
+		case UMULG:
+		case UDIVG:
+			g = column_at(column, ncolumns, in->arg, row);
+			if (!g) {
+				/* a missing column is all zero */
+				if (in->op == UMULG)
+					memset(x, 0, n * sizeof(vmcell));
+				break;
+			}
+			switch (in->op) {
+			case IADDG:
+				for (l = 0; l < n; l++)
+					x[l] += g[l];
+				break;
+			case ISUBG:
+				for (l = 0; l < n; l++)
+					x[l] -= g[l];
+				break;
+			case UMULG:
+				for (l = 0; l < n; l++)
+					x[l] *= g[l];
+				break;
+			default:
+				for (l = 0; l < n; l++)
+					x[l] = g[l] ? x[l] / g[l] : x[l];
+			}
+			break;
+		}
+	}
+}
+
+static int run_rows(struct vmstate *vm, const vmcell *const *column,
+	unsigned ncolumns, vmcell *out, size_t row, size_t n)
+{
+	size_t r;
+	unsigned i;
+
+	for (r = row; r < row + n; r++) {
+		for (i = 0; i < ncolumns; i++)
+			vm_global_set(vm, i, column[i] ? column[i][r] : 0);
+		if (vm_run(vm))
+			return -1;
+		out[r] = vm_result(vm);
+	}
+	return 0;
+}
+
+/* everything one thread needs to run a batch program */
+struct batchctx {
+	lanes *stack; /* NULL for scalar programs */
+	struct vmstate *vm; /* created on the first block that needs it */
+};
+
+struct batchctx *batchctx_new(const struct batch *b)
+{
+	struct batchctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	if (!b->scalar) {
+		ctx->stack = malloc(sizeof(*ctx->stack) * (b->max_stack + 2));
+		if (!ctx->stack) {
+			free(ctx);
+			return NULL;
+		}
+	}
+	return ctx;
+}
+
+void batchctx_free(struct batchctx *ctx)
+{
+	if (!ctx)
+		return;
+	vm_free(ctx->vm);
+	free(ctx->stack);
+	free(ctx);
+}
+
+/* evaluate rows begin to end-1, storing the results in out.
+ * returns 0 on success. */
+int batch_exec(const struct batch *b, struct batchctx *ctx,
+	const vmcell *const *column, unsigned ncolumns, vmcell *out,
+	size_t begin, size_t end)
+{
+	size_t row;
+
+	for (row = begin; row < end; row += BATCH_LANES) {
+		unsigned n = end - row < BATCH_LANES ? end - row : BATCH_LANES;
+
+		if (ctx->stack && run_block(b, ctx->stack, column, ncolumns, out, row, n))
+			continue;
+		TRACE_FMT("block at row %zu runs scalar\n", row);
+		if (!ctx->vm) {
+			ctx->vm = vm_new(b->code, b->code_len, b->nglobals);
+			if (!ctx->vm)
+				return -1;
+		}
+		if (run_rows(ctx->vm, column, ncolumns, out, row, n))
+			return -1;
+	}
+	return 0;
+}
+
+int batch_run(const struct batch *b, const vmcell *const *column,
+	unsigned ncolumns, vmcell *out, size_t nrows)
+{
+	struct batchctx *ctx;
+	int res;
+
+	ctx = batchctx_new(b);
+	if (!ctx)
+		return -1;
+	res = batch_exec(b, ctx, column, ncolumns, out, 0, nrows);
+	batchctx_free(ctx);
+	return res;
+}
+
+struct parjob {
+	const struct batch *b;
+	struct batchctx **ctx; /* one per worker */
+	const vmcell *const *column;
+	unsigned ncolumns;
+	vmcell *out;
+	unsigned char *failed; /* one per worker */
+};
+
+static void par_chunk(void *arg, unsigned worker, size_t begin, size_t end)
+{
+	struct parjob *job = arg;
+
+	if (!job->ctx[worker])
+		job->ctx[worker] = batchctx_new(job->b);
+	if (!job->ctx[worker] || batch_exec(job->b, job->ctx[worker],
+		job->column, job->ncolumns, job->out, begin, end))
+		job->failed[worker] = 1;
+}
+
+/* like batch_run(), spreading the rows over the threads of pool. the
+ * program is shared, each worker gets its own stacks. */
+int batch_run_pool(const struct batch *b, struct pool *pool,
+	const vmcell *const *column, unsigned ncolumns, vmcell *out, size_t nrows)
+{
+	struct parjob job = { b, NULL, column, ncolumns, out, NULL };
+	unsigned i, n = pool_size(pool);
+	int res = 0;
+
+	job.ctx = calloc(n, sizeof(*job.ctx));
+	job.failed = calloc(n, 1);
+	if (!job.ctx || !job.failed) {
+		free(job.failed);
+		free(job.ctx);
+		return -1;
+	}
+	pool_run(pool, nrows, BATCH_CHUNK, par_chunk, &job);
+	for (i = 0; i < n; i++) {
+		if (job.failed[i])
+			res = -1;
+		batchctx_free(job.ctx[i]);
+	}
+	free(job.failed);
+	free(job.ctx);
+	return res;
+}
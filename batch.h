@@ -0,0 +1,20 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stddef.h>
+#include "vm.h"
+struct batch;
+struct batchctx;
+struct pool;
+
+struct batch *batch_new(const unsigned char *code, unsigned code_len, unsigned nglobals);
+void batch_free(struct batch *b);
+int batch_run(const struct batch *b, const vmcell *const *column,
+	unsigned ncolumns, vmcell *out, size_t nrows);
+struct batchctx *batchctx_new(const struct batch *b);
+void batchctx_free(struct batchctx *ctx);
+int batch_exec(const struct batch *b, struct batchctx *ctx,
+	const vmcell *const *column, unsigned ncolumns, vmcell *out,
+	size_t begin, size_t end);
+int batch_run_pool(const struct batch *b, struct pool *pool,
+	const vmcell *const *column, unsigned ncolumns, vmcell *out, size_t nrows);
+#endif
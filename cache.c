@@ -0,0 +1,302 @@
+/* cache.c : compiled programs kept by the hash of their source. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Sources are normalized by dropping whitespace that does not separate two
+ * words, so "a + b" and "a+b" share an entry. The key is a 64-bit FNV-1a hash
+ * of the normalized text, the text itself is kept to rule out collisions.
+ *
+ * Replacement is CLOCK: a hit sets an entry's reference bit, and the hand
+ * evicts the first entry it finds with the bit clear, clearing bits as it
+ * passes.
+ *
+ * The cache does not compile anything itself. A caller that misses compiles
+ * the source with its own parser, which reports errors the way it always
+ * does, and hands the result to cache_add(). Everything is allocated with
+ * mem_alloc(), so the same allocator must be current for every call on a
+ * cache. A cache is not locked, one thread may use it at a time.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "cache.h"
+#include "mem.h"
+#include "stats.h"
+
+struct entry {
+	uint64_t hash;
+	char *key; /* normalized source */
+	size_t key_len;
+	struct cached prog;
+	int next; /* hash chain, -1 ends it */
+	unsigned char ref;
+};
+
+struct cache {
+	struct entry *entry;
+	unsigned capacity;
+	unsigned count;
+	unsigned hand;
+	int *bucket; /* first entry of each chain */
+	unsigned mask;
+	char *norm; /* scratch for normalizing */
+	size_t norm_max;
+	unsigned long hits, misses, evictions;
+};
+
+static int is_word(int ch)
+{
+	return isalnum(ch) || ch == '_';
+}
+
+/* returns the length of the normalized text, left in c->norm */
+static size_t normalize(struct cache *c, const char *src, size_t len)
+{
+	size_t i, n = 0;
+	int space = 0;
+
+	if (len > c->norm_max) {
+		char *tmp = mem_realloc(c->norm, len);
+
+		if (!tmp)
+			return (size_t)-1;
+		c->norm = tmp;
+		c->norm_max = len;
+	}
+	for (i = 0; i < len; i++) {
+		unsigned char ch = src[i];
+
+		if (isspace(ch)) {
+			space = 1;
+			continue;
+		}
+		if (space && n && is_word(c->norm[n - 1]) && is_word(ch))
+			c->norm[n++] = ' ';
+		space = 0;
+		c->norm[n++] = ch;
+	}
+	return n;
+}
+
+static uint64_t hash64(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+struct cache *cache_new(unsigned capacity)
+{
+	struct cache *c;
+	unsigned i, nbuckets = 1;
+
+	if (!capacity)
+		return NULL;
+	while (nbuckets < capacity)
+		nbuckets *= 2;
+	c = mem_calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->capacity = capacity;
+	c->mask = nbuckets - 1;
+	c->entry = mem_calloc(capacity, sizeof(*c->entry));
+	c->bucket = mem_alloc(sizeof(*c->bucket) * nbuckets);
+	if (!c->entry || !c->bucket) {
+		cache_free(c);
+		return NULL;
+	}
+	for (i = 0; i < nbuckets; i++)
+		c->bucket[i] = -1;
+	return c;
+}
+
+static void entry_clear(struct entry *e)
+{
+	mem_free(e->key);
+	mem_free(e->prog.name);
+	vm_code_free(&e->prog.code);
+	memset(e, 0, sizeof(*e));
+}
+
+void cache_free(struct cache *c)
+{
+	unsigned i;
+
+	if (!c)
+		return;
+	if (c->entry) {
+		for (i = 0; i < c->capacity; i++)
+			entry_clear(&c->entry[i]);
+	}
+	mem_free(c->entry);
+	mem_free(c->bucket);
+	mem_free(c->norm);
+	mem_free(c);
+}
+
+static void unlink_entry(struct cache *c, unsigned idx)
+{
+	int *link = &c->bucket[c->entry[idx].hash & c->mask];
+
+	while (*link != (int)idx)
+		link = &c->entry[*link].next;
+	*link = c->entry[idx].next;
+}
+
+/* index of a free slot, evicting if the cache is full */
+static unsigned victim(struct cache *c)
+{
+	unsigned idx;
+
+	if (c->count < c->capacity)
+		return c->count++;
+	while (c->entry[c->hand].ref) {
+		c->entry[c->hand].ref = 0;
+		c->hand = (c->hand + 1) % c->capacity;
+	}
+	idx = c->hand;
+	c->hand = (c->hand + 1) % c->capacity;
+	unlink_entry(c, idx);
+	entry_clear(&c->entry[idx]);
+	c->evictions++;
+	STATS_ADD(cache_evictions, 1);
+	return idx;
+}
+
+/* the entry for the n bytes of normalized text in c->norm, or NULL */
+static struct entry *lookup(struct cache *c, uint64_t hash, size_t n)
+{
+	struct entry *e;
+	int i;
+
+	for (i = c->bucket[hash & c->mask]; i != -1; i = c->entry[i].next) {
+		e = &c->entry[i];
+		if (e->hash == hash && e->key_len == n && !memcmp(e->key, c->norm, n))
+			return e;
+	}
+	return NULL;
+}
+
+/* the program compiled from src, or NULL if it is not cached. it stays
+ * valid until the next call on c. */
+const struct cached *cache_find(struct cache *c, const char *src, size_t len)
+{
+	struct entry *e;
+	size_t n;
+
+	n = normalize(c, src, len);
+	e = n == (size_t)-1 ? NULL : lookup(c, hash64(c->norm, n), n);
+	if (!e) {
+		c->misses++;
+		STATS_ADD(cache_misses, 1);
+		return NULL;
+	}
+	c->hits++;
+	STATS_ADD(cache_hits, 1);
+	e->ref = 1;
+	return &e->prog;
+}
+
+/* copies of the identifiers in one block, the pointers first */
+static const char **copy_names(const char *const *name, unsigned n)
+{
+	const char **out;
+	size_t size = sizeof(*out) * (n ? n : 1);
+	unsigned i;
+	char *s;
+
+	for (i = 0; i < n; i++)
+		size += strlen(name[i]) + 1;
+	out = mem_alloc(size);
+	if (!out)
+		return NULL;
+	s = (char *)(out + (n ? n : 1));
+	for (i = 0; i < n; i++) {
+		size_t len = strlen(name[i]) + 1;
+
+		out[i] = memcpy(s, name[i], len);
+		s += len;
+	}
+	return out;
+}
+
+/* keeps a copy of code, compiled from src, and of name, the identifiers of
+ * its globals if the caller wants them back. code that does not pass
+ * vm_verify() is refused. returns the cached program, valid until the next
+ * call on c, or NULL if it could not be added. */
+const struct cached *cache_add(struct cache *c, const char *src, size_t len,
+	const struct vmcode *code, const char *const *name)
+{
+	struct entry *e;
+	struct cached prog;
+	uint64_t hash;
+	size_t n;
+	unsigned idx;
+	char *key;
+
+	n = normalize(c, src, len);
+	if (n == (size_t)-1)
+		return NULL;
+	hash = hash64(c->norm, n);
+	e = lookup(c, hash, n);
+	if (e)
+		return &e->prog;
+
+	memset(&prog, 0, sizeof(prog));
+	prog.max_stack = vm_verify(code->buf, code->len, code->nglobals, NULL);
+	if (prog.max_stack < 0)
+		return NULL;
+	key = mem_alloc(n ? n : 1);
+	prog.code.buf = mem_alloc(code->len ? code->len : 1);
+	if (name)
+		prog.name = copy_names(name, code->nglobals);
+	if (!key || !prog.code.buf || (name && !prog.name)) {
+		mem_free(key);
+		mem_free(prog.code.buf);
+		mem_free(prog.name);
+		return NULL;
+	}
+	memcpy(key, c->norm, n);
+	memcpy(prog.code.buf, code->buf, code->len);
+	prog.code.len = prog.code.max = code->len;
+	prog.code.nglobals = code->nglobals;
+
+	idx = victim(c);
+	e = &c->entry[idx];
+	e->hash = hash;
+	e->key = key;
+	e->key_len = n;
+	e->prog = prog;
+	e->next = c->bucket[hash & c->mask];
+	c->bucket[hash & c->mask] = idx;
+	return &e->prog;
+}
+
+void cache_stats(const struct cache *c, struct cache_stats *stats)
+{
+	stats->hits = c->hits;
+	stats->misses = c->misses;
+	stats->evictions = c->evictions;
+	stats->entries = c->count;
+	stats->capacity = c->capacity;
+}
@@ -0,0 +1,28 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+#include "vm.h"
+struct cache;
+
+/* a compiled program as the cache keeps it */
+struct cached {
+	struct vmcode code; /* without a line table */
+	int max_stack; /* from vm_verify() */
+	const char **name; /* identifier of each global slot, or NULL */
+};
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned entries;
+	unsigned capacity;
+};
+
+struct cache *cache_new(unsigned capacity);
+void cache_free(struct cache *c);
+const struct cached *cache_find(struct cache *c, const char *src, size_t len);
+const struct cached *cache_add(struct cache *c, const char *src, size_t len,
+	const struct vmcode *code, const char *const *name);
+void cache_stats(const struct cache *c, struct cache_stats *stats);
+#endif
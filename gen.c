@@ -16,19 +16,44 @@
  */
 
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
 
 #include "ast.h"
 #include "vm.h"
 #include "gen.h"
+#include "peep.h"
+#include "stats.h"
+#include "mem.h"
 #include "trace.h"
 
+/* the rest of the stack is left for evaluating */
+#define CSE_TEMPS_MAX (VM_STACK_MAX / 4)
+
+/* an if whose arms cost this much together evaluates both and picks one with
+ * SELECT. then it runs as many instructions as with JZ and JMP and never
+ * mispredicts, but more than that loses to a branch that predicts well. */
+#define SELECT_COST_MAX 2
+
+/* instructions are collected in a list, jump targets are instruction
+ * numbers until peephole() lays them out as bytes. each instruction is
+ * tagged with the source position of the node it came from. */
 struct codeinfo {
-	vmcell *code;
-	unsigned code_max;
+	struct vminsn *insn;
+	struct vmline *pos; /* pc is filled in after layout */
+	unsigned n;
+	unsigned max;
+	unsigned nglobals;
+	unsigned line, ofs; /* position for the next instruction */
+	struct ast_map temp; /* the temp slot keeping each shared node */
+	unsigned char *set; /* the temp holds its value at this point of the code */
+	unsigned *avail; /* temps set, ~0u where an arm begins */
+	unsigned navail;
+	unsigned avail_max;
+	int nomem;
 };
 
-static enum vmop vmop(enum ast_op op)
+/* the instruction computing op on the top two cells */
+enum vmop gen_op(enum ast_op op)
 {
 	switch (op) {
 	case O_ADD: return IADD;
@@ -41,100 +66,450 @@ static enum vmop vmop(enum ast_op op)
 	return HALT;
 }
 
-static void gen(vmcell v, struct codeinfo *info)
+/* superinstruction taking the right operand as an immediate */
+static enum vmop vmop_imm(enum ast_op op)
 {
-	*info->code++ = v;
-	info->code_max--;
+	switch (op) {
+	case O_ADD: return IADDI;
+	case O_SUB: return ISUBI;
+	case O_MUL: return UMULI;
+	case O_DIV: return UDIVI;
+	case O_ERR: ;
+	}
+	return HALT;
+}
+
+/* superinstruction taking the right operand from a global */
+static enum vmop vmop_global(enum ast_op op)
+{
+	switch (op) {
+	case O_ADD: return IADDG;
+	case O_SUB: return ISUBG;
+	case O_MUL: return UMULG;
+	case O_DIV: return UDIVG;
+	case O_ERR: ;
+	}
+	return HALT;
+}
+
+/* append an instruction, returning its number */
+static unsigned gen(enum vmop op, vmcell arg, struct codeinfo *info)
+{
+	if (info->n == info->max) {
+		unsigned max = info->max ? info->max * 2 : 64;
+		struct vminsn *insn = mem_realloc(info->insn, sizeof(*insn) * max);
+		struct vmline *pos;
+
+		if (!insn) {
+			info->nomem = 1;
+			return info->n;
+		}
+		info->insn = insn;
+		pos = mem_realloc(info->pos, sizeof(*pos) * max);
+		if (!pos) {
+			info->nomem = 1;
+			return info->n;
+		}
+		info->pos = pos;
+		info->max = max;
+	}
+	info->insn[info->n].op = op;
+	info->insn[info->n].arg = arg;
+	info->insn[info->n].target = 0;
+	info->pos[info->n].line = info->line;
+	info->pos[info->n].ofs = info->ofs;
+	return info->n++;
 }
 
 static void gen_2op(enum ast_op op, struct codeinfo *info)
 {
-	gen(vmop(op), info);
+	gen(gen_op(op), 0, info);
 }
 
-static void gen_num(long num, struct codeinfo *info)
+static void gen_num(long num, enum vmop op, struct codeinfo *info)
 {
 	// TODO: support numbers of different sizes (64-bit, ...)
-	gen(IPUSH, info);
-	gen(num, info);
+	gen(op, num, info);
+}
+
+/* the parser numbered the identifiers in order of first use, that is the
+ * global slot. */
+static int gen_var(ast_node node, enum vmop op, struct codeinfo *info)
+{
+	gen(op, node->sym, info);
+	if (node->sym >= info->nglobals)
+		info->nglobals = node->sym + 1;
+	return 1;
 }
 
-static void gen_var(const char *id, struct codeinfo *info)
+/* number of the next instruction to be generated */
+static unsigned here(struct codeinfo *info)
 {
-	int i;
+	return info->n;
+}
 
-	/* TODO: use some allocation scheme */
-	i = tolower(id[0]) - 'a';
-	if (i < 0 || i >= 26)
-		i = 0; // TODO: an error occured ...
-	gen(IFETCH, info);
-	gen(i, info);
+/* make the jump numbered src go to dst. */
+static void fix(struct codeinfo *info, unsigned src, unsigned dst)
+{
+	if (src < info->n)
+		info->insn[src].target = dst;
+	TRACE_FMT("fix %04x -> %04x\n", src, dst);
 }
 
-/* current posisition in the generated object file */
-static vmcell *here(struct codeinfo *info)
+/* instructions generated next belong to node */
+static void at(ast_node node, struct codeinfo *info)
 {
-	return info->code;
+	info->line = node->line;
+	info->ofs = node->ofs;
 }
 
-/* reserve a cell, returning it's offset */
-static vmcell *hole(struct codeinfo *info)
+/* the parser shares identical subtrees, so the tree is really a DAG. */
+
+static int is_leaf(ast_node n)
 {
-	vmcell *pos = here(info);
+	return n->type == N_NUM || n->type == N_VAR;
+}
 
-	gen(0xdeadbeef, info); /* store a dummy value */
-	return pos;
+/* the same node as both operands is a copy of the left one, not a use */
+static int same_operands(ast_node n)
+{
+	return n->type == N_2OP && n->left == n->right;
 }
 
-/* patch a memory location at src with the offset to dst. */
-static void fix(vmcell *src, const vmcell *dst)
+/* visits each node once, finding the ones with more than one parent. the
+ * first max of them that are worth computing once are given a temp slot in
+ * temp. returns the number of temps, or -1 if out of memory. */
+static int share(ast_node root, unsigned max, struct ast_map *temp)
 {
-	*src = dst - src;
-	TRACE_FMT("fix %04x\n", *src);
+	struct ast_map seen;
+	struct ast_stack s;
+	ast_node n, *child;
+	unsigned i;
+	int temps = 0;
+
+	ast_map_init(&seen);
+	ast_stack_init(&s);
+	if (!ast_map_set(&seen, root, 0) || !ast_push(&s, root, 0))
+		temps = -1;
+	while (temps >= 0 && s.n) {
+		n = s.frame[--s.n].node;
+		for (i = 0; temps >= 0 && (child = ast_child(n, i)); i++) {
+			if (!*child || is_leaf(*child) || (i == 1 && same_operands(n)))
+				continue;
+			if (ast_map_get(&seen, *child) == ~0u) {
+				if (!ast_map_set(&seen, *child, 0) || !ast_push(&s, *child, 0))
+					temps = -1;
+			} else if ((unsigned)temps < max && ast_map_get(temp, *child) == ~0u) {
+				temps = ast_map_set(temp, *child, temps) ? temps + 1 : -1;
+			}
+		}
+	}
+	ast_stack_free(&s);
+	ast_map_free(&seen);
+	return temps;
 }
 
-static int c(ast_node node, struct codeinfo *info)
+/* the temp slot holding n's value at this point of the code, or ~0u */
+static unsigned avail(ast_node n, const struct codeinfo *info)
 {
-	switch (node->type) {
-	case N_2OP:
-		c(node->left, info);
-		c(node->right, info);
-		gen_2op(node->op, info);
-		return 1;
-	case N_NUM:
-		gen_num(node->num, info);
-		return 1;
-	case N_VAR:
-		gen_var(node->id, info);
-		return 1;
-	case N_COND: {
-		vmcell *patch1, *patch2;
-
-		/* TODO: support conditions missing an else ... */
-
-		c(node->left, info); /* condition */
-		gen(JZ, info); patch1 = hole(info); /* calculate JZ's destination later... */
-		c(node->arg[0], info); /* true condition */
-		gen(JMP, info); patch2 = hole(info); /* calculate JMP's destination later... */
-		fix(patch1, here(info)); /* destination for JZ */
-		c(node->arg[1], info); /* false condition */
-		fix(patch2, here(info)); /* destination for JMP */
-		TRACE_FMT("patch1=%04x patch2=%04x\n", *patch1, *patch2);
+	unsigned slot;
+
+	if (is_leaf(n) || !info->temp.n)
+		return ~0u;
+	slot = ast_map_get(&info->temp, n);
+
+	return slot != ~0u && info->set[slot] ? slot : ~0u;
+}
+
+static void avail_push(unsigned slot, struct codeinfo *info)
+{
+	if (info->navail == info->avail_max) {
+		unsigned max = info->avail_max ? info->avail_max * 2 : 64;
+		unsigned *tmp = mem_realloc(info->avail, sizeof(*tmp) * max);
+
+		if (!tmp) {
+			info->nomem = 1;
+			return;
+		}
+		info->avail = tmp;
+		info->avail_max = max;
+	}
+	info->avail[info->navail++] = slot;
+	if (slot != ~0u)
+		info->set[slot] = 1;
+}
+
+/* the code generated next may not run, forget the temps it sets once
+ * avail_leave() is called */
+static void avail_enter(struct codeinfo *info)
+{
+	avail_push(~0u, info);
+}
+
+static void avail_leave(struct codeinfo *info)
+{
+	unsigned slot;
+
+	while (info->navail && (slot = info->avail[--info->navail]) != ~0u)
+		info->set[slot] = 0;
+}
+
+/* node's value is on top of the stack, keep a copy if it is used again */
+static void keep(ast_node node, struct codeinfo *info)
+{
+	unsigned slot = ast_map_get(&info->temp, node);
+
+	if (slot == ~0u)
+		return;
+	at(node, info);
+	gen(TSTORE, slot, info);
+	avail_push(slot, info);
+}
+
+/* roughly what evaluating n costs, in instructions with a division counting
+ * as several. counting stops once it is past budget, and every call below
+ * gets less budget than its caller, which keeps the recursion shallow. */
+static unsigned cost(ast_node n, unsigned budget, const struct codeinfo *info)
+{
+	unsigned c;
+
+	if (is_leaf(n) || avail(n, info) != ~0u)
 		return 1;
+	switch (n->type) {
+	case N_2OP:
+		c = n->op == O_DIV ? 4 : 1;
+		if (c <= budget)
+			c += cost(n->left, budget - c, info);
+		if (c <= budget && !is_leaf(n->right) && !same_operands(n))
+			c += cost(n->right, budget - c, info);
+		return c;
+	case N_COND:
+		c = 1;
+		if (c <= budget)
+			c += cost(n->left, budget - c, info);
+		if (c <= budget)
+			c += cost(n->arg[0], budget - c, info);
+		if (c <= budget)
+			c += cost(n->arg[1], budget - c, info);
+		return c;
+	default:
+		return budget + 1;
+	}
+}
+
+/* both arms of the if are cheap enough to evaluate without branching.
+ * nothing has side effects, so only the time is lost on the unused one. */
+static int if_convert(ast_node n, const struct codeinfo *info)
+{
+	unsigned c = cost(n->arg[0], SELECT_COST_MAX, info);
+
+	return c <= SELECT_COST_MAX && c + cost(n->arg[1], SELECT_COST_MAX - c, info) <= SELECT_COST_MAX;
+}
+
+/* walks the tree with an explicit stack. a frame's step says which part of
+ * its node comes next, the frame's mark holds a jump waiting for its
+ * destination. a node whose value is already in a temp is fetched instead
+ * of walked again. */
+static int c(ast_node root, struct codeinfo *info)
+{
+	struct ast_stack s;
+	struct ast_frame *f;
+	ast_node node, next;
+	unsigned slot;
+	int ok = 1;
+
+	ast_stack_init(&s);
+	if (!ast_push(&s, root, 0))
+		goto nomem;
+	while (s.n) {
+		f = &s.frame[s.n - 1];
+		node = f->node;
+		next = NULL;
+		switch (node->type) {
+		case N_2OP:
+			switch (f->step++) {
+			case 0:
+				next = node->left;
+				break;
+			case 1:
+				at(node, info);
+				/* a leaf on the right folds into the operator */
+				if (node->right->type == N_NUM) {
+					gen_num(node->right->num, vmop_imm(node->op), info);
+					keep(node, info);
+					s.n--;
+				} else if (node->right->type == N_VAR) {
+					gen_var(node->right, vmop_global(node->op), info);
+					keep(node, info);
+					s.n--;
+				} else if (same_operands(node)) {
+					gen(IDUP, 0, info);
+				} else {
+					next = node->right;
+				}
+				break;
+			default:
+				at(node, info);
+				gen_2op(node->op, info);
+				keep(node, info);
+				s.n--;
+			}
+			break;
+		case N_NUM:
+			at(node, info);
+			gen_num(node->num, IPUSH, info);
+			s.n--;
+			break;
+		case N_VAR:
+			at(node, info);
+			gen_var(node, IFETCH, info);
+			s.n--;
+			break;
+		case N_COND:
+			switch (f->step++) {
+			case 0:
+				next = node->left; /* condition */
+				break;
+			case 1:
+				if (if_convert(node, info)) {
+					f->step = 4;
+					next = node->arg[0];
+					break;
+				}
+				at(node, info);
+				f->mark = gen(JZ, 0, info); /* calculate JZ's destination later... */
+				avail_enter(info);
+				next = node->arg[0]; /* true condition */
+				break;
+			case 2:
+				avail_leave(info);
+				at(node, info);
+				fix(info, f->mark, here(info) + 1); /* destination for JZ */
+				f->mark = gen(JMP, 0, info); /* calculate JMP's destination later... */
+				avail_enter(info);
+				next = node->arg[1]; /* false condition */
+				break;
+			case 3:
+				avail_leave(info);
+				fix(info, f->mark, here(info)); /* destination for JMP */
+				keep(node, info);
+				s.n--;
+				break;
+			/* if-converted, both arms always run so their temps stay set */
+			case 4:
+				next = node->arg[1];
+				break;
+			default:
+				at(node, info);
+				gen(SELECT, 0, info);
+				keep(node, info);
+				s.n--;
+			}
+			break;
+		default:
+			/* TODO: report compile error on the first failure */
+			ok = 0;
+			goto out;
+		}
+		if (next && (slot = avail(next, info)) != ~0u) {
+			at(next, info);
+			gen(TFETCH, slot, info);
+		} else if (next && !ast_push(&s, next, 0)) {
+			goto nomem;
+		}
 	}
+out:
+	ast_stack_free(&s);
+	return ok;
+nomem:
+	info->nomem = 1;
+	goto out;
+}
+
+/* fill in out's line table from the pc of each instruction, ~0u for the ones
+ * the peephole pass removed. runs with the same position are merged. */
+static int gen_lines(const struct codeinfo *info, const unsigned *pc, struct vmcode *out)
+{
+	struct vmline *l;
+	unsigned i;
+
+	out->nlines = 0;
+	for (i = 0; i < info->n; i++) {
+		if (pc[i] == ~0u)
+			continue;
+		l = out->nlines ? &out->lines[out->nlines - 1] : NULL;
+		if (l && l->line == info->pos[i].line && l->ofs == info->pos[i].ofs)
+			continue;
+		if (out->nlines == out->lines_max) {
+			unsigned max = out->lines_max ? out->lines_max * 2 : 64;
+
+			l = mem_realloc(out->lines, sizeof(*l) * max);
+			if (!l)
+				return 0;
+			out->lines = l;
+			out->lines_max = max;
+		}
+		l = &out->lines[out->nlines++];
+		*l = info->pos[i];
+		l->pc = pc[i];
 	}
-	/* TODO: report compile error on the first failure */
-	return 0;
+	return 1;
 }
 
-int compile(ast_node root, vmcell *code, unsigned *code_max)
+/* compiles root into out, giving up to max_temps shared nodes a temp. the
+ * number given is stored in temps. returns 0 if out of memory. */
+static int generate(ast_node root, struct vmcode *out, unsigned max_temps, int *temps)
 {
-	struct codeinfo info = { code, *code_max };
+	struct codeinfo info = { NULL, NULL, 0, 0, 0, 1, 0, { NULL, 0, 0 }, NULL, NULL, 0, 0, 0 };
+	unsigned *pc = NULL;
 	int res;
 
-	res = c(root, &info);
-	gen(HALT, &info);
-	*code_max = *code_max - info.code_max;
-	printf("Code size = %d\n", *code_max);
+	*temps = share(root, max_temps, &info.temp);
+	res = *temps >= 0;
+	if (res) {
+		info.set = mem_calloc(*temps ? *temps : 1, 1);
+		res = info.set != NULL;
+	}
+	if (res && *temps)
+		gen(TALLOC, *temps, &info);
+	if (res)
+		res = c(root, &info);
+	gen(HALT, 0, &info);
+	if (res && !info.nomem) {
+		pc = mem_alloc(sizeof(*pc) * info.n);
+		if (!pc)
+			info.nomem = 1;
+	}
+	if (info.nomem)
+		res = 0;
+	out->len = 0;
+	out->nlines = 0;
+	out->nglobals = info.nglobals;
+	if (res && (!peephole(info.insn, info.n, out, pc) || !gen_lines(&info, pc, out)))
+		res = 0;
+	mem_free(pc);
+	mem_free(info.avail);
+	mem_free(info.set);
+	ast_map_free(&info.temp);
+	mem_free(info.pos);
+	mem_free(info.insn);
+	return res;
+}
+
+/* replaces the contents of out with the encoded program. values the tree
+ * shares are computed once and kept in temps. returns 0 if out of memory,
+ * nothing is printed. */
+int compile(ast_node root, struct vmcode *out)
+{
+	unsigned long long start = stats_clock();
+	int res, temps;
+
+	res = generate(root, out, CSE_TEMPS_MAX, &temps);
+	/* the temps sit under the evaluation stack, drop them if both do not fit */
+	if (res && temps > 0 && vm_verify(out->buf, out->len, out->nglobals, NULL) < 0)
+		res = generate(root, out, 0, &temps);
+	if (res)
+		STATS_ADD(code_bytes, out->len);
+	stats_phase(PHASE_COMPILE, start);
 	return res;
 }
@@ -2,5 +2,7 @@
 #ifndef GEN_H
 #define GEN_H
 #include "vm.h"
-int compile(ast_node root, vmcell *code, unsigned *code_max);
+
+int compile(ast_node root, struct vmcode *out);
+enum vmop gen_op(enum ast_op op);
 #endif
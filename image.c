@@ -0,0 +1,183 @@
+/* image.c : compiled programs saved to and mapped from files. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* an image is the header followed directly by the encoded code, which can be
+ * handed to vm_new() in place. the header is in host byte order and the
+ * operands are sized for a vmcell, the loader rejects images written on a
+ * host that differs in either. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vm.h"
+#include "image.h"
+
+struct image {
+	void *map;
+	size_t map_len;
+	const struct image_header *header;
+	const unsigned char *code;
+};
+
+static int write_all(int fd, const void *p, size_t len)
+{
+	const char *s = p;
+
+	while (len) {
+		ssize_t cnt = write(fd, s, len);
+
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		s += cnt;
+		len -= cnt;
+	}
+	return 0;
+}
+
+/* returns 0 on success. */
+int image_write(const char *filename, const struct vmcode *code)
+{
+	struct image_header h;
+	int fd, max_stack;
+
+	max_stack = vm_verify(code->buf, code->len, code->nglobals, NULL);
+	if (max_stack < 0) {
+		fprintf(stderr, "ERROR:%s:invalid code\n", filename);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = IMAGE_VERSION;
+	h.header_size = sizeof(h);
+	h.cell_size = sizeof(vmcell);
+	h.code_len = code->len;
+	h.nglobals = code->nglobals;
+	h.max_stack = max_stack;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		goto failed;
+	if (write_all(fd, &h, sizeof(h)) || write_all(fd, code->buf, code->len)) {
+		close(fd);
+		goto failed;
+	}
+	if (close(fd))
+		goto failed;
+	return 0;
+failed:
+	fprintf(stderr, "ERROR:%s:%s\n", filename, strerror(errno));
+	return -1;
+}
+
+static const char *check_header(const struct image_header *h, size_t len)
+{
+	if (len < sizeof(*h) || memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)))
+		return "not an image";
+	if (h->version != IMAGE_VERSION)
+		return "unsupported version";
+	if (h->cell_size != sizeof(vmcell) || h->header_size != sizeof(*h))
+		return "image built for another host";
+	if (h->code_len != len - sizeof(*h))
+		return "code length does not match the file";
+	if (h->max_stack > VM_STACK_MAX)
+		return "program too large";
+	return NULL;
+}
+
+struct image *image_open(const char *filename)
+{
+	struct image *im;
+	struct stat sb;
+	const char *err;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR:%s:%s\n", filename, strerror(errno));
+		return NULL;
+	}
+	im = calloc(1, sizeof(*im));
+	if (!im) {
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || sb.st_size <= 0) {
+		fprintf(stderr, "ERROR:%s:not a regular file\n", filename);
+		goto failed;
+	}
+	im->map_len = sb.st_size;
+	im->map = mmap(NULL, im->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (im->map == MAP_FAILED) {
+		im->map = NULL;
+		fprintf(stderr, "ERROR:%s:%s\n", filename, strerror(errno));
+		goto failed;
+	}
+	im->header = im->map;
+	err = check_header(im->header, im->map_len);
+	if (err) {
+		fprintf(stderr, "ERROR:%s:%s\n", filename, err);
+		goto failed;
+	}
+	im->code = (const unsigned char*)(im->header + 1);
+	/* the code is run without checks, so a damaged file must not get that far */
+	if (vm_verify(im->code, im->header->code_len, im->header->nglobals, NULL)
+		!= (int)im->header->max_stack) {
+		fprintf(stderr, "ERROR:%s:invalid code\n", filename);
+		goto failed;
+	}
+	close(fd);
+	return im;
+failed:
+	close(fd);
+	image_close(im);
+	return NULL;
+}
+
+/* the code returned by image_code() is unmapped here. */
+void image_close(struct image *im)
+{
+	if (!im)
+		return;
+	if (im->map)
+		munmap(im->map, im->map_len);
+	free(im);
+}
+
+const unsigned char *image_code(const struct image *im, unsigned *code_len)
+{
+	*code_len = im->header->code_len;
+	return im->code;
+}
+
+unsigned image_globals(const struct image *im)
+{
+	return im->header->nglobals;
+}
+
+unsigned image_max_stack(const struct image *im)
+{
+	return im->header->max_stack;
+}
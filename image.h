@@ -0,0 +1,28 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include "vm.h"
+struct image;
+
+#define IMAGE_MAGIC "LBC\0"
+#define IMAGE_VERSION 2
+
+/* on-disk layout, followed by code_len bytes of code. all fields use host
+ * order. */
+struct image_header {
+	char magic[4];
+	unsigned version;
+	unsigned header_size; /* offset of the code */
+	unsigned cell_size; /* sizeof(vmcell) */
+	unsigned code_len; /* in bytes */
+	unsigned nglobals; /* global slots the program needs */
+	unsigned max_stack;
+	unsigned reserved;
+};
+
+int image_write(const char *filename, const struct vmcode *code);
+struct image *image_open(const char *filename);
+void image_close(struct image *im);
+const unsigned char *image_code(const struct image *im, unsigned *code_len);
+unsigned image_globals(const struct image *im);
+unsigned image_max_stack(const struct image *im);
+#endif
@@ -0,0 +1,342 @@
+/* jit.c : translates VM bytecode into x86-64 machine code. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Register use (System V ABI):
+ *
+ * rdi - base of the globals, IFETCH i is a load from [rdi + 4*i]
+ * eax - top of the VM stack
+ * the rest of the VM stack lives on the native stack, one quadword per cell
+ * rbp - frame pointer, HALT restores rsp from it so the stack depth at
+ *       HALT does not matter. temp i is at [rbp - 8*(i+1)], TALLOC pushes
+ *       them as zeros before the rest of the stack is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "trace.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+
+#define JIT_INSN_MAX 24 /* longest native sequence for one instruction */
+
+struct jit {
+	unsigned char *mem;
+	size_t mem_len;
+};
+
+struct fixup {
+	unsigned pos; /* offset of a rel32 field */
+	unsigned target; /* bytecode pc it refers to */
+};
+
+struct jitbuf {
+	unsigned char *p;
+	unsigned len;
+};
+
+static void emit(struct jitbuf *a, const void *bytes, unsigned n)
+{
+	memcpy(a->p + a->len, bytes, n);
+	a->len += n;
+}
+
+#define EMIT(a, ...) do { \
+		static const unsigned char b_[] = { __VA_ARGS__ }; \
+		emit((a), b_, sizeof(b_)); \
+	} while (0)
+
+static void emit32(struct jitbuf *a, vmcell v)
+{
+	unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	emit(a, b, 4);
+}
+
+/* ModRM byte for [rdi + disp32] with reg as the register operand */
+#define RDI_DISP32(reg) (0x87 | ((reg) << 3))
+#define EAX 0
+#define ECX 1
+
+/* op, then a ModRM byte for [rbp + disp32], for temp slot i */
+static void emit_temp(struct jitbuf *a, unsigned char op, vmcell i)
+{
+	unsigned char b[2] = { op, 0x85 };
+
+	emit(a, b, 2);
+	emit32(a, -8 * (i + 1));
+}
+
+static void emit_global(struct jitbuf *a, const unsigned char *op, unsigned n, int reg, vmcell slot)
+{
+	unsigned char modrm = RDI_DISP32(reg);
+
+	emit(a, op, n);
+	emit(a, &modrm, 1);
+	emit32(a, slot * sizeof(vmcell));
+}
+
+/* returns 0 for an instruction it cannot translate. */
+static int translate(struct jitbuf *a, const struct vminsn *insn,
+	struct fixup *fix, unsigned *nfix)
+{
+	static const unsigned char mov_load[] = { 0x8b }, mov_store[] = { 0x89 },
+		add_load[] = { 0x03 }, sub_load[] = { 0x2b }, imul_load[] = { 0x0f, 0xaf };
+
+	switch (insn->op) {
+	case IFETCH: case ISTORE:
+	case IADDG: case ISUBG: case UMULG: case UDIVG:
+		/* the slot has to fit a signed 32-bit displacement */
+		if (insn->arg > 0x7fffffff / sizeof(vmcell))
+			return 0;
+		break;
+	default:
+		break;
+	}
+
+	switch (insn->op) {
+	case HALT:
+		EMIT(a, 0xc9, 0xc3); /* leave; ret */
+		return 1;
+	case IFETCH:
+		EMIT(a, 0x50); /* push rax */
+		emit_global(a, mov_load, 1, EAX, insn->arg);
+		return 1;
+	case ISTORE:
+		emit_global(a, mov_store, 1, EAX, insn->arg);
+		EMIT(a, 0x58); /* pop rax */
+		return 1;
+	case IPUSH:
+		EMIT(a, 0x50, 0xb8); /* push rax; mov eax, imm32 */
+		emit32(a, insn->arg);
+		return 1;
+	case IPOP:
+		EMIT(a, 0x58); /* pop rax */
+		return 1;
+	case IADD:
+		EMIT(a, 0x59, 0x01, 0xc8); /* pop rcx; add eax, ecx */
+		return 1;
+	case ISUB:
+		/* pop rcx; sub ecx, eax; mov eax, ecx */
+		EMIT(a, 0x59, 0x29, 0xc1, 0x89, 0xc8);
+		return 1;
+	case UMUL:
+		EMIT(a, 0x59, 0x0f, 0xaf, 0xc1); /* pop rcx; imul eax, ecx */
+		return 1;
+	case UDIV:
+		/* pop rcx; xchg eax, ecx; test ecx, ecx; jz 1f;
+		 * xor edx, edx; div ecx; 1: */
+		EMIT(a, 0x59, 0x91, 0x85, 0xc9, 0x74, 0x04, 0x31, 0xd2, 0xf7, 0xf1);
+		return 1;
+	case ILT:
+		/* pop rcx; cmp ecx, eax; setb al; movzx eax, al */
+		EMIT(a, 0x59, 0x39, 0xc1, 0x0f, 0x92, 0xc0, 0x0f, 0xb6, 0xc0);
+		return 1;
+	case JZ:
+	case JNZ:
+		/* test eax, eax; pop rax; jz/jnz rel32 */
+		EMIT(a, 0x85, 0xc0, 0x58, 0x0f);
+		if (insn->op == JZ)
+			EMIT(a, 0x84);
+		else
+			EMIT(a, 0x85);
+		break;
+	case JMP:
+		EMIT(a, 0xe9); /* jmp rel32 */
+		break;
+	case IADDI:
+		EMIT(a, 0x05); /* add eax, imm32 */
+		emit32(a, insn->arg);
+		return 1;
+	case ISUBI:
+		EMIT(a, 0x2d); /* sub eax, imm32 */
+		emit32(a, insn->arg);
+		return 1;
+	case UMULI:
+		EMIT(a, 0x69, 0xc0); /* imul eax, eax, imm32 */
+		emit32(a, insn->arg);
+		return 1;
+	case UDIVI:
+		if (insn->arg == 0 || insn->arg == 1)
+			return 1; /* leaves the dividend alone */
+		EMIT(a, 0xb9); /* mov ecx, imm32; xor edx, edx; div ecx */
+		emit32(a, insn->arg);
+		EMIT(a, 0x31, 0xd2, 0xf7, 0xf1);
+		return 1;
+	case IADDG:
+		emit_global(a, add_load, 1, EAX, insn->arg);
+		return 1;
+	case ISUBG:
+		emit_global(a, sub_load, 1, EAX, insn->arg);
+		return 1;
+	case UMULG:
+		emit_global(a, imul_load, 2, EAX, insn->arg);
+		return 1;
+	case UDIVG:
+		/* mov ecx, [global]; test ecx, ecx; jz 1f; xor edx, edx; div ecx; 1: */
+		emit_global(a, mov_load, 1, ECX, insn->arg);
+		EMIT(a, 0x85, 0xc9, 0x74, 0x04, 0x31, 0xd2, 0xf7, 0xf1);
+		return 1;
+	case IDUP:
+		EMIT(a, 0x50); /* push rax */
+		return 1;
+	case TALLOC:
+		/* the temps start out 0 as in the VM, push that many zeros:
+		 * mov ecx, imm32; 1: push 0; dec ecx; jnz 1b */
+		if (!insn->arg)
+			return 1;
+		EMIT(a, 0xb9);
+		emit32(a, insn->arg);
+		EMIT(a, 0x6a, 0x00, 0xff, 0xc9, 0x75, 0xfa);
+		return 1;
+	case TSTORE:
+		emit_temp(a, 0x89, insn->arg); /* mov [rbp - 8*(i+1)], eax */
+		return 1;
+	case TFETCH:
+		EMIT(a, 0x50); /* push rax; mov eax, [rbp - 8*(i+1)] */
+		emit_temp(a, 0x8b, insn->arg);
+		return 1;
+	case SELECT:
+		/* pop rcx; pop rdx; test edx, edx; cmovnz eax, ecx */
+		EMIT(a, 0x59, 0x5a, 0x85, 0xd2, 0x0f, 0x45, 0xc1);
+		return 1;
+	default:
+		return 0;
+	}
+
+	/* jumps, the displacement is patched once every pc has an address */
+	fix[*nfix].pos = a->len;
+	fix[*nfix].target = insn->target;
+	(*nfix)++;
+	emit32(a, 0);
+	return 1;
+}
+
+/* returns NULL if the code uses anything the translator does not handle, the
+ * caller should run it with vm_run() instead. the globals passed to the
+ * compiled function must have a slot for every global the code uses. */
+struct jit *jit_compile(const unsigned char *code, unsigned code_len)
+{
+	struct jit *j = NULL;
+	struct jitbuf a = { NULL, 0 };
+	struct fixup *fix = NULL;
+	unsigned *native = NULL, nfix = 0, temps = 0, pc, i;
+	struct vminsn insn;
+	enum vmop last = HALT;
+	size_t mem_len;
+
+	/* the translation trusts the stack depths vm_verify() proves */
+	if (vm_verify(code, code_len, ~0u, NULL) < 0)
+		return NULL;
+	mem_len = (size_t)code_len * JIT_INSN_MAX + 16;
+	native = malloc(sizeof(*native) * (code_len + 1));
+	fix = malloc(sizeof(*fix) * code_len);
+	if (!native || !fix)
+		goto fail;
+	a.p = mmap(NULL, mem_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (a.p == MAP_FAILED) {
+		a.p = NULL;
+		goto fail;
+	}
+
+	EMIT(&a, 0x55, 0x48, 0x89, 0xe5); /* push rbp; mov rbp, rsp */
+	for (pc = 0; pc < code_len; pc++)
+		native[pc] = ~0u;
+	for (pc = 0; pc < code_len; pc += insn.len) {
+		if (!vm_decode(code, code_len, pc, &insn))
+			goto fail;
+		native[pc] = a.len;
+		/* the temps are made once, before anything is pushed */
+		if (insn.op == TALLOC && pc)
+			goto fail;
+		if (insn.op == TALLOC)
+			temps = insn.arg;
+		if ((insn.op == TSTORE || insn.op == TFETCH) && insn.arg >= temps)
+			goto fail;
+		if (!translate(&a, &insn, fix, &nfix))
+			goto fail;
+		last = insn.op;
+	}
+	/* execution must not run off the end */
+	if (last != HALT && last != JMP)
+		goto fail;
+	for (i = 0; i < nfix; i++) {
+		unsigned t = fix[i].target;
+
+		if (t >= code_len || native[t] == ~0u)
+			goto fail;
+		memcpy(&a.p[fix[i].pos], &(int){ native[t] - (fix[i].pos + 4) }, 4);
+	}
+	if (mprotect(a.p, mem_len, PROT_READ | PROT_EXEC))
+		goto fail;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		goto fail;
+	j->mem = a.p;
+	j->mem_len = mem_len;
+	TRACE_FMT("jit %u bytes -> %u bytes\n", code_len, a.len);
+	free(fix);
+	free(native);
+	return j;
+fail:
+	if (a.p)
+		munmap(a.p, mem_len);
+	free(fix);
+	free(native);
+	return NULL;
+}
+
+jit_func jit_entry(struct jit *j)
+{
+	jit_func f;
+
+	memcpy(&f, &j->mem, sizeof(f)); /* object to function pointer */
+	return f;
+}
+
+void jit_free(struct jit *j)
+{
+	if (!j)
+		return;
+	munmap(j->mem, j->mem_len);
+	free(j);
+}
+#else
+struct jit *jit_compile(const unsigned char *code, unsigned code_len)
+{
+	(void)code;
+	(void)code_len;
+	return NULL; /* no native backend for this target */
+}
+
+jit_func jit_entry(struct jit *j)
+{
+	(void)j;
+	return NULL;
+}
+
+void jit_free(struct jit *j)
+{
+	(void)j;
+}
+#endif
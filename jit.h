@@ -0,0 +1,10 @@
+#ifndef JIT_H
+#define JIT_H
+#include "vm.h"
+typedef vmcell (*jit_func)(vmcell *global);
+struct jit;
+
+struct jit *jit_compile(const unsigned char *code, unsigned code_len);
+jit_func jit_entry(struct jit *j);
+void jit_free(struct jit *j);
+#endif
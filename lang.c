@@ -16,46 +16,669 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
+#include "arena.h"
 #include "ast.h"
 #include "parse.h"
+#include "opt.h"
 #include "gen.h"
+#include "jit.h"
+#include "cache.h"
+#include "image.h"
+#include "pool.h"
+#include "prof.h"
+#include "tok.h"
+#include "vm.h"
+#include "stats.h"
 
-#define CODE_MAX 2048 /* maximum compiled size */
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-S] [-j] [-o image] [file]\n"
+		"       %s [-S] -p [file]\n"
+		"       %s [-S] [-j] -i image\n"
+		"       %s [-S] -s [file]\n"
+		"       %s [-S] [-j] [-t threads] -m file|dir...\n"
+		"  -S   count what each phase does and print it as JSON to stderr\n"
+		"  -j   run native code, if the program can be translated\n"
+		"  -p   run in the interpreter and report the hottest source positions\n"
+		"       and instructions\n"
+		"  -o   save the compiled program to image instead of running it\n"
+		"  -i   run a program saved with -o\n"
+		"  -s   evaluate each line or ';' separated expression as it arrives,\n"
+		"       printing one result or \"error\" per expression\n"
+		"  -m   compile and run every file, and every .p file in each directory,\n"
+		"       on a pool of threads, printing the results in the order given\n"
+		"  -t   number of threads for -m, one per processor by default\n",
+		prog, prog, prog, prog, prog);
+}
+
+/* runs code as native code with all globals 0. returns 0 if the code could
+ * not be translated. */
+static int jit_result(const unsigned char *code, unsigned code_len, unsigned nglobals,
+	vmcell *result)
+{
+	vmcell *global;
+	struct jit *j;
+
+	global = calloc(nglobals ? nglobals : 1, sizeof(*global));
+	if (!global)
+		return 0;
+	j = jit_compile(code, code_len);
+	if (!j) {
+		free(global);
+		return 0;
+	}
+	*result = jit_entry(j)(global);
+	jit_free(j);
+	free(global);
+	return 1;
+}
+
+/* returns 0 if the code could not be translated. */
+static int run_jit(const unsigned char *code, unsigned code_len, unsigned nglobals)
+{
+	vmcell result;
+
+	if (!jit_result(code, code_len, nglobals, &result))
+		return 0;
+	printf("result = %d\n", result);
+	return 1;
+}
+
+/* returns 0 on success. */
+static int run(const unsigned char *code, unsigned code_len, unsigned nglobals, int use_jit)
+{
+	struct vmstate *vm;
+
+	printf("Running...\n");
+	if (use_jit && run_jit(code, code_len, nglobals)) {
+		printf("Done!\n");
+		return 0;
+	}
+	/* code that fails verification is refused here too */
+	vm = vm_new(code, code_len, nglobals);
+	if (!vm) {
+		fprintf(stderr, "CANNOT LOAD PROGRAM!\n");
+		return 1;
+	}
+#ifndef NDEBUG
+	vm_dump(vm);
+#endif
+	vm_run(vm);
+	printf("result = %d\n", vm_result(vm));
+	vm_free(vm);
+	printf("Done!\n");
+	return 0;
+}
+
+/* runs code with execution counts on and prints where they went. src is
+ * the program's text, for the report. returns 0 on success. */
+static int run_profile(const struct vmcode *code, const char *src, size_t len)
+{
+	struct vmprofile prof;
+	struct vmstate *vm = NULL;
+	int ret = 1;
+
+	printf("Running...\n");
+	prof.count = calloc(code->len + 1, sizeof(*prof.count));
+	prof.taken = calloc(code->len + 1, sizeof(*prof.taken));
+	if (!prof.count || !prof.taken) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		goto out;
+	}
+	vm = vm_new(code->buf, code->len, code->nglobals);
+	if (!vm) {
+		fprintf(stderr, "CANNOT LOAD PROGRAM!\n");
+		goto out;
+	}
+	vm_profile(vm, &prof);
+	vm_run(vm);
+	printf("result = %d\n", vm_result(vm));
+	printf("Done!\n");
+	if (!profile_report(stdout, code, &prof, src, len, 10)) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	vm_free(vm);
+	free(prof.taken);
+	free(prof.count);
+	return ret;
+}
+
+/* reads all of fd into *buf, which holds *max bytes and is grown as needed.
+ * returns 0 on error, *buf is still to be freed. */
+static int read_into(int fd, char **buf, size_t *max, size_t *len)
+{
+	char *tmp;
+	ssize_t cnt;
+
+	*len = 0;
+	do {
+		if (*len == *max) {
+			tmp = realloc(*buf, *max ? *max * 2 : 65536);
+			if (!tmp)
+				return 0;
+			*buf = tmp;
+			*max = *max ? *max * 2 : 65536;
+		}
+		cnt = read(fd, *buf + *len, *max - *len);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		if (cnt < 0)
+			return 0;
+		*len += cnt;
+	} while (cnt);
+	return 1;
+}
+
+/* reads all of fd into a malloc'd buffer, NULL on error. */
+static char *read_all(int fd, size_t *len)
+{
+	char *buf = NULL;
+	size_t max = 0;
+
+	if (!read_into(fd, &buf, &max, len)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* the frontend is skipped entirely, the code runs straight from the mapping. */
+static int run_image(const char *filename, int use_jit)
+{
+	struct image *im;
+	const unsigned char *code;
+	unsigned code_len;
+	int ret;
+
+	im = image_open(filename);
+	if (!im)
+		return 1;
+	code = image_code(im, &code_len);
+	printf("Code size = %d\n", code_len);
+	ret = run(code, code_len, image_globals(im), use_jit);
+	image_close(im);
+	return ret;
+}
+
+static void dump_stats(void)
+{
+	stats_dump_json(stderr);
+}
+
+#define STREAM_CACHE 1024 /* expressions -s keeps compiled */
+
+/* everything reused from one streamed expression to the next */
+struct stream {
+	struct arena *arena;
+	struct pstate *st;
+	struct vmcode code;
+	struct vmstate *vm;
+	struct cache *cache;
+};
+
+static void stream_eval(struct stream *s, const char *expr, size_t len)
+{
+	const struct cached *hit;
+	const struct vmcode *code = NULL;
+	ast_node root;
+	size_t i;
+
+	for (i = 0; i < len && isspace((unsigned char)expr[i]); i++)
+		;
+	if (i == len)
+		return; /* blank */
+	/* an expression seen before is not compiled again */
+	hit = cache_find(s->cache, expr, len);
+	if (hit) {
+		code = &hit->code;
+	} else {
+		arena_reset(s->arena);
+		pstate_reset(s->st, expr, len);
+		root = parse_pstate(s->st);
+		if (!root)
+			error_print(s->st);
+		if (root && compile(optimize(root), &s->code)) {
+			code = &s->code;
+			cache_add(s->cache, expr, len, &s->code, NULL);
+		}
+	}
+	if (code && !vm_load(s->vm, code->buf, code->len, code->nglobals)
+		&& !vm_run(s->vm))
+		printf("%d\n", vm_result(s->vm));
+	else
+		printf("error\n");
+}
+
+/* results are written as soon as there is no more input waiting. */
+static int stream(int fd)
+{
+	struct stream s = { NULL, NULL, { NULL, 0, 0, 0, NULL, 0, 0 }, NULL, NULL };
+	char *buf = NULL, *tmp;
+	size_t len = 0, max = 0, start, i;
+	ssize_t cnt;
+	int ret = 1;
+
+	s.arena = arena_new();
+	if (s.arena)
+		s.st = pstate_new_buffer(s.arena, "", 0);
+	if (s.st)
+		s.vm = vm_new(NULL, 0, 0);
+	if (s.vm)
+		s.cache = cache_new(STREAM_CACHE);
+	if (!s.cache) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		goto out;
+	}
+	do {
+		if (len == max) {
+			max = max ? max * 2 : 65536;
+			tmp = realloc(buf, max);
+			if (!tmp) {
+				fprintf(stderr, "OUT OF MEMORY!\n");
+				goto out;
+			}
+			buf = tmp;
+		}
+		fflush(stdout);
+		cnt = read(fd, buf + len, max - len);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		if (cnt < 0) {
+			fprintf(stderr, "ERROR:%s\n", strerror(errno));
+			goto out;
+		}
+		len += cnt;
+		/* evaluate every complete expression, keep the partial one */
+		for (start = i = 0; i < len; i++) {
+			if (buf[i] == '\n' || buf[i] == ';') {
+				stream_eval(&s, buf + start, i - start);
+				start = i + 1;
+			}
+		}
+		if (!cnt)
+			stream_eval(&s, buf + start, len - start);
+		memmove(buf, buf + start, len - start);
+		len -= start;
+	} while (cnt);
+	ret = 0;
+out:
+	fflush(stdout);
+	cache_free(s.cache);
+	vm_free(s.vm);
+	vm_code_free(&s.code);
+	pstate_free(s.st);
+	arena_free(s.arena);
+	free(buf);
+	return ret;
+}
+
+/* the outcome of one file run with -m */
+struct outcome {
+	const char *error; /* NULL if it ran */
+	int err; /* errno if the file could not be read, the main thread formats it */
+	int line, ofs; /* where a parse error is, line is 0 for other errors */
+	vmcell result;
+};
+
+/* everything a worker reuses from one file to the next */
+struct worker {
+	struct arena *arena;
+	struct pstate *st;
+	struct vmcode code;
+	struct vmstate *vm;
+	char *buf;
+	size_t max;
+};
+
+struct many {
+	char **name;
+	struct outcome *out;
+	struct worker *worker;
+	int use_jit;
+};
 
-int main()
+static void many_file(struct worker *w, const char *name, struct outcome *o, int use_jit)
 {
-	vmcell code[CODE_MAX];
-	unsigned code_len = CODE_MAX;
 	ast_node root;
+	size_t len;
+	int fd;
+
+	o->line = 0;
+	o->err = 0;
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		o->error = "cannot open";
+		o->err = errno;
+		return;
+	}
+	if (!read_into(fd, &w->buf, &w->max, &len)) {
+		o->error = "cannot read";
+		o->err = errno;
+		close(fd);
+		return;
+	}
+	close(fd);
+	arena_reset(w->arena);
+	pstate_reset(w->st, w->buf, len);
+	root = parse_pstate(w->st);
+	if (!root) {
+		o->error = error_msg(w->st, &o->line, &o->ofs);
+		if (!o->error)
+			o->error = "parse error";
+		return;
+	}
+	if (!compile(optimize(root), &w->code)) {
+		o->error = "compile error";
+		return;
+	}
+	o->error = NULL;
+	if (use_jit && jit_result(w->code.buf, w->code.len, w->code.nglobals, &o->result))
+		return;
+	if (vm_load(w->vm, w->code.buf, w->code.len, w->code.nglobals) || vm_run(w->vm)) {
+		o->error = "cannot load program";
+		return;
+	}
+	o->result = vm_result(w->vm);
+}
+
+static void many_work(void *arg, unsigned worker, size_t begin, size_t end)
+{
+	struct many *m = arg;
+	size_t i;
+
+	for (i = begin; i < end; i++)
+		many_file(&m->worker[worker], m->name[i], &m->out[i], m->use_jit);
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* appends a copy of name to the list. returns 0 if out of memory. */
+static int add_name(char ***list, size_t *n, size_t *max, const char *dir, const char *name)
+{
+	char **tmp, *s;
+
+	if (*n == *max) {
+		tmp = realloc(*list, sizeof(**list) * (*max ? *max * 2 : 64));
+		if (!tmp)
+			return 0;
+		*list = tmp;
+		*max = *max ? *max * 2 : 64;
+	}
+	s = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+	if (!s)
+		return 0;
+	if (dir)
+		sprintf(s, "%s/%s", dir, name);
+	else
+		strcpy(s, name);
+	(*list)[(*n)++] = s;
+	return 1;
+}
+
+/* adds the .p files of dir, sorted so the order does not depend on the
+ * filesystem. returns 0 on error. */
+static int add_dir(char ***list, size_t *n, size_t *max, const char *dir)
+{
+	struct dirent *d;
+	size_t first = *n, len;
+	DIR *dp;
+	int ok = 1;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "ERROR:%s:%s\n", dir, strerror(errno));
+		return 0;
+	}
+	while (ok && (d = readdir(dp))) {
+		len = strlen(d->d_name);
+		if (len > 2 && !strcmp(d->d_name + len - 2, ".p"))
+			ok = add_name(list, n, max, dir, d->d_name);
+	}
+	closedir(dp);
+	if (!ok)
+		fprintf(stderr, "OUT OF MEMORY!\n");
+	qsort(*list + first, *n - first, sizeof(**list), by_name);
+	return ok;
+}
+
+/* compiles and runs each of the files on nthreads threads, each with its own
+ * parser and VM. results are printed in the order the files were given. */
+static int many(char **arg, int narg, unsigned nthreads, int use_jit)
+{
+	struct many m = { NULL, NULL, NULL, use_jit };
+	struct pool *pool = NULL;
+	struct stat sb;
+	size_t n = 0, max = 0, i;
+	unsigned nworkers = 0;
+	int ret = 1;
+
+	for (i = 0; i < (size_t)narg; i++) {
+		if (!stat(arg[i], &sb) && S_ISDIR(sb.st_mode)) {
+			if (!add_dir(&m.name, &n, &max, arg[i]))
+				goto out;
+		} else if (!add_name(&m.name, &n, &max, NULL, arg[i])) {
+			fprintf(stderr, "OUT OF MEMORY!\n");
+			goto out;
+		}
+	}
+	pool = pool_new(nthreads);
+	if (pool) {
+		nworkers = pool_size(pool);
+		m.worker = calloc(nworkers, sizeof(*m.worker));
+		m.out = calloc(n ? n : 1, sizeof(*m.out));
+	}
+	for (i = 0; m.worker && i < nworkers; i++) {
+		struct worker *w = &m.worker[i];
+
+		w->arena = arena_new();
+		if (w->arena)
+			w->st = pstate_new_buffer(w->arena, "", 0);
+		if (w->st)
+			w->vm = vm_new(NULL, 0, 0);
+		if (!w->vm)
+			break;
+	}
+	if (!m.out || i < nworkers) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		goto out;
+	}
+
+	/* files differ in size, hand them out one at a time */
+	pool_run(pool, n, 1, many_work, &m);
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		const struct outcome *o = &m.out[i];
+
+		if (!o->error)
+			printf("%s: result = %d\n", m.name[i], o->result);
+		else if (o->err)
+			printf("%s: ERROR:%s\n", m.name[i], strerror(o->err));
+		else if (o->line)
+			printf("%s: ERROR:line=%d,ofs=%d:%s\n", m.name[i], o->line, o->ofs, o->error);
+		else
+			printf("%s: ERROR:%s\n", m.name[i], o->error);
+		if (o->error)
+			ret = 1;
+	}
+out:
+	for (i = 0; m.worker && i < nworkers; i++) {
+		struct worker *w = &m.worker[i];
+
+		vm_free(w->vm);
+		vm_code_free(&w->code);
+		pstate_free(w->st);
+		arena_free(w->arena);
+		free(w->buf);
+	}
+	free(m.worker);
+	free(m.out);
+	pool_free(pool);
+	for (i = 0; i < n; i++)
+		free(m.name[i]);
+	free(m.name);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct vmcode code = { NULL, 0, 0, 0, NULL, 0, 0 };
+	struct arena *arena;
+	ast_node root = NULL;
+	const char *out = NULL;
+	char *src = NULL;
+	size_t src_len = 0;
+	int c, use_jit = 0, use_image = 0, use_stream = 0, use_prof = 0, use_many = 0;
+	unsigned nthreads = 0;
+
+	while ((c = getopt(argc, argv, "Sjo:ispmt:")) != -1) {
+		switch (c) {
+		case 'S':
+			stats_enable(1);
+			atexit(dump_stats);
+			break;
+		case 'j':
+			use_jit = 1;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'i':
+			use_image = 1;
+			break;
+		case 's':
+			use_stream = 1;
+			break;
+		case 'p':
+			use_prof = 1;
+			break;
+		case 'm':
+			use_many = 1;
+			break;
+		case 't':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (use_image) {
+		if (optind >= argc || out) {
+			usage(argv[0]);
+			return 1;
+		}
+		return run_image(argv[optind], use_jit);
+	}
+
+	if (use_many) {
+		if (optind >= argc || out || use_stream || use_prof) {
+			usage(argv[0]);
+			return 1;
+		}
+		return many(argv + optind, argc - optind, nthreads, use_jit);
+	}
+
+	if (use_stream) {
+		int fd = STDIN_FILENO;
+
+		if (optind < argc) {
+			fd = open(argv[optind], O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "ERROR:%s:%s\n", argv[optind], strerror(errno));
+				return 1;
+			}
+		}
+		c = stream(fd);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return c;
+	}
+
+	arena = arena_new();
+	if (!arena) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		return 1;
+	}
+
+	/* the report quotes the source, so keep a copy of it */
+	if (use_prof) {
+		const char *name = optind < argc ? argv[optind] : "stdin";
+		int fd = optind < argc ? open(name, O_RDONLY) : STDIN_FILENO;
+
+		if (fd >= 0)
+			src = read_all(fd, &src_len);
+		if (!src) {
+			fprintf(stderr, "ERROR:%s:%s\n", name, strerror(errno));
+			arena_free(arena);
+			return 1;
+		}
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
 
 	printf("Parsing...\n");
-	root = parse();
+	if (src) {
+		/* a shared node would charge every use of it to the first one */
+		struct pstate *st = pstate_new_buffer(arena, src, src_len);
+
+		if (st) {
+			pstate_share(st, 0);
+			root = parse_pstate(st);
+			error_print(st);
+			pstate_free(st);
+		}
+	} else if (optind < argc)
+		root = parse_file(arena, argv[optind]);
+	else
+		root = parse(arena);
 	if (!root) {
 		fprintf(stderr, "PARSE ERROR!\n");
+		arena_free(arena);
+		free(src);
 		return 1;
 	}
 	ast_node_dump(root);
 	printf("\n");
 
+	root = optimize(root);
+
 	printf("Compiling...\n");
 
-	if (!compile(root, code, &code_len)) {
+	if (!compile(root, &code)) {
 		fprintf(stderr, "COMPILE ERROR!\n");
-		ast_node_free(root);
+		arena_free(arena);
+		vm_code_free(&code);
+		free(src);
 		return 1;
 	}
 
-	struct vmstate *vm;
-	ast_node_free(root);
-	printf("Running...\n");
-	vm = vm_new(code, code_len);
-#ifndef NDEBUG
-	vm_dump(vm);
-#endif
-	vm_run(vm);
-	vm_free(vm);
-	printf("Done!\n");
+	printf("Code size = %d\n", code.len);
+	arena_free(arena);
 
-	return 0;
+	if (out)
+		c = image_write(out, &code) ? 1 : 0;
+	else if (use_prof)
+		c = run_profile(&code, src, src_len);
+	else
+		c = run(code.buf, code.len, code.nglobals, use_jit);
+	vm_code_free(&code);
+	free(src);
+	return c;
 }
@@ -0,0 +1,293 @@
+/* langbench.c : measures the throughput of each phase on a set of programs. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* each phase is repeated until it has run for a minimum time, and the best
+ * of several such rounds is reported. that keeps the numbers steady enough
+ * to compare between commits on the same machine.
+ *
+ *   tok    MB/s of source through the lexer alone
+ *   parse  ast nodes/s built by the parser, lexing included
+ *   gen    instructions/s out of the code generator, peephole included
+ *   vm     instructions/s executed by vm_run()
+ *   run    microseconds for one vm_run(), the number to compare when a change
+ *          alters how many instructions a program executes
+ *
+ * before each run the globals get new pseudo-random values, the same sequence
+ * every time, so conditions on them are not decided the same way each run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "tok.h"
+#include "parse.h"
+#include "opt.h"
+#include "gen.h"
+#include "vm.h"
+#include "stats.h"
+
+#define ROUNDS 5
+
+struct job {
+	const char *src;
+	size_t len;
+	struct arena *arena;
+	ast_node root;
+	struct vmcode code;
+	struct vmstate *vm;
+	vmcell rng; /* state for the globals */
+};
+
+static double min_time = 0.2; /* seconds per round */
+
+/* xorshift32 */
+static void random_globals(struct job *job)
+{
+	vmcell x = job->rng;
+	unsigned i;
+
+	for (i = 0; i < job->code.nglobals; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		vm_global_set(job->vm, i, x);
+	}
+	job->rng = x;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* best rate of calls to fn per second, or 0 if it failed */
+static double measure(int (*fn)(struct job *), struct job *job)
+{
+	double best = 0, start, elapsed;
+	unsigned long reps;
+	int round;
+
+	for (round = 0; round < ROUNDS; round++) {
+		reps = 0;
+		start = now();
+		do {
+			if (!fn(job))
+				return 0;
+			reps++;
+			elapsed = now() - start;
+		} while (elapsed < min_time);
+		if (reps / elapsed > best)
+			best = reps / elapsed;
+	}
+	return best;
+}
+
+static int run_tok(struct job *job)
+{
+	struct pstate *st;
+
+	arena_reset(job->arena);
+	st = pstate_new_buffer(job->arena, job->src, job->len);
+	if (!st)
+		return 0;
+	while (tok_cur(st) != T_EOF)
+		tok_next(st);
+	pstate_free(st);
+	return 1;
+}
+
+static int run_parse(struct job *job)
+{
+	arena_reset(job->arena);
+	return parse_buffer(job->arena, job->src, job->len) != NULL;
+}
+
+static int run_gen(struct job *job)
+{
+	return compile(job->root, &job->code);
+}
+
+static int run_vm(struct job *job)
+{
+	random_globals(job);
+	return !vm_run(job->vm);
+}
+
+/* parses the tree used by the later phases, returning the nodes the parser
+ * built for it, shared ones included, as counted by the parser itself */
+static unsigned long parse_nodes(struct job *job)
+{
+	struct stats st;
+
+	stats_reset();
+	stats_enable(1);
+	arena_reset(job->arena);
+	job->root = parse_buffer(job->arena, job->src, job->len);
+	stats_enable(0);
+	stats_get(&st);
+	return st.nodes;
+}
+
+static unsigned long count_insns(const struct vmcode *code)
+{
+	struct vminsn insn;
+	unsigned long n = 0;
+	unsigned pc;
+
+	for (pc = 0; pc < code->len; pc += insn.len, n++) {
+		if (!vm_decode(code->buf, code->len, pc, &insn))
+			break;
+	}
+	return n;
+}
+
+/* instructions executed by one run, counted by the VM itself */
+static unsigned long count_steps(struct vmstate *vm)
+{
+	struct stats st;
+
+	stats_reset();
+	stats_enable(1);
+	vm_run(vm);
+	stats_enable(0);
+	stats_get(&st);
+	return st.insns;
+}
+
+static char *slurp(const char *filename, size_t *len)
+{
+	FILE *f;
+	char *buf = NULL, *tmp;
+	size_t max = 0, cnt;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "ERROR:%s:%s\n", filename, strerror(errno));
+		return NULL;
+	}
+	*len = 0;
+	do {
+		if (*len == max) {
+			max = max ? max * 2 : 65536;
+			tmp = realloc(buf, max);
+			if (!tmp) {
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		cnt = fread(buf + *len, 1, max - *len, f);
+		*len += cnt;
+	} while (cnt);
+	fclose(f);
+	return buf;
+}
+
+static int bench(const char *filename)
+{
+	struct job job;
+	unsigned long nodes, insns, steps;
+	double tok, parse, gen, vm;
+	char *src;
+	int ret = 1;
+
+	memset(&job, 0, sizeof(job));
+	src = slurp(filename, &job.len);
+	if (!src)
+		return 1;
+	job.src = src;
+	job.arena = arena_new();
+	if (!job.arena)
+		goto out;
+
+	tok = measure(run_tok, &job);
+	parse = measure(run_parse, &job);
+	/* no more resets after this */
+	nodes = parse_nodes(&job);
+	if (!job.root) {
+		fprintf(stderr, "ERROR:%s:does not parse\n", filename);
+		goto out;
+	}
+	job.root = optimize(job.root);
+	gen = measure(run_gen, &job);
+	if (!gen) {
+		fprintf(stderr, "ERROR:%s:does not compile\n", filename);
+		goto out;
+	}
+	insns = count_insns(&job.code);
+	job.vm = vm_new(job.code.buf, job.code.len, job.code.nglobals);
+	if (!job.vm) {
+		fprintf(stderr, "ERROR:%s:cannot load program\n", filename);
+		goto out;
+	}
+	job.rng = 2463534242u;
+	random_globals(&job);
+	steps = count_steps(job.vm);
+	vm = measure(run_vm, &job);
+
+	printf("%-24s %9zu %9.2f %9.2f %9.2f %9.2f %9.1f\n", filename, job.len,
+		tok * job.len / 1e6, parse * nodes / 1e6,
+		gen * insns / 1e6, vm * steps / 1e6, 1e6 / vm);
+	ret = 0;
+out:
+	vm_free(job.vm);
+	vm_code_free(&job.code);
+	arena_free(job.arena);
+	free(src);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t seconds] file...\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	printf("%-24s %9s %9s %9s %9s %9s %9s\n", "", "bytes", "tok", "parse", "gen", "vm", "run");
+	printf("%-24s %9s %9s %9s %9s %9s %9s\n", "", "", "MB/s", "Mnode/s", "Minsn/s", "Minsn/s",
+		"us");
+	for (; optind < argc; optind++)
+		ret |= bench(argv[optind]);
+	return ret;
+}
@@ -0,0 +1,537 @@
+/* langcheck.c : runs random programs on every engine and compares the results. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Each program is made from a seed, compiled by the normal frontend and run
+ * over a set of random rows of globals. vm_exec() gives the expected value
+ * of every row, every other way of running the program must agree with it.
+ * A failure prints the seed, which reproduces the program and its rows.
+ * Crafted code that must never run is checked to be refused by each of them,
+ * and deeply nested input to compile without running out of native stack.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "parse.h"
+#include "opt.h"
+#include "gen.h"
+#include "vm.h"
+#include "jit.h"
+#include "batch.h"
+#include "pool.h"
+#include "react.h"
+#include "image.h"
+
+#define ROWS_MAX 70000 /* enough for several chunks of batch_run_pool() */
+#define IDS_MAX 8
+#define DEEP 300000 /* levels, far more than recursion would survive */
+
+static unsigned long long rng_state;
+
+/* xorshift64*, as in progen.c */
+static unsigned rnd(unsigned n)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (unsigned)((rng_state * 2685821657736338717ull) >> 32) % n;
+}
+
+/* a growing string */
+struct text {
+	char *p;
+	size_t len, max;
+};
+
+static void put(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(t->p + t->len, t->max - t->len, fmt, ap);
+	va_end(ap);
+	if (t->len + n >= t->max) {
+		t->max = (t->len + n) * 2 + 64;
+		t->p = realloc(t->p, t->max);
+		if (!t->p) {
+			fprintf(stderr, "OUT OF MEMORY!\n");
+			exit(1);
+		}
+		va_start(ap, fmt);
+		vsnprintf(t->p + t->len, t->max - t->len, fmt, ap);
+		va_end(ap);
+	}
+	t->len += n;
+}
+
+/* random expression of about size leaves. a subtree is sometimes written
+ * twice by replaying the random numbers, so the parser has something to
+ * share. */
+static void expr(struct text *t, unsigned size, unsigned nids)
+{
+	static const char ops[] = "+-*/";
+	unsigned long long replay;
+	unsigned left;
+
+	if (size <= 1) {
+		switch (rnd(6)) {
+		case 0:
+			put(t, "%u", rnd(3));
+			break;
+		case 1:
+			put(t, "%u", rnd(4000000000u));
+			break;
+		default:
+			put(t, "v%u", rnd(nids));
+		}
+		return;
+	}
+	if (size >= 3 && !rnd(4)) {
+		put(t, "(if (");
+		expr(t, size / 3, nids);
+		put(t, ") then ");
+		expr(t, size / 3, nids);
+		put(t, " else ");
+		expr(t, size - 2 * (size / 3), nids);
+		put(t, ")");
+		return;
+	}
+	left = 1 + rnd(size - 1);
+	put(t, "(");
+	if (!rnd(6)) {
+		replay = rng_state;
+		expr(t, left, nids);
+		put(t, " %c ", ops[rnd(4)]);
+		rng_state = replay;
+		expr(t, left, nids);
+	} else {
+		expr(t, left, nids);
+		put(t, " %c ", ops[rnd(4)]);
+		expr(t, size - left, nids);
+	}
+	put(t, ")");
+}
+
+/* one program and its rows, global i of row r is column[i][r] */
+struct prog {
+	unsigned long long seed;
+	struct text src;
+	ast_node root; /* optimized, in the arena */
+	struct vmcode code;
+	int depth;
+	vmcell **column;
+	vmcell *want;
+	vmcell *got;
+	size_t nrows;
+};
+
+static int failed;
+
+static void report(const struct prog *p, const char *engine, size_t row)
+{
+	fprintf(stderr, "langcheck: seed %llu: %s row %zu gives %u, vm_exec() %u\n",
+		p->seed, engine, row, p->got[row], p->want[row]);
+	if (p->src.len < 2000)
+		fprintf(stderr, "  %s\n", p->src.p);
+	failed = 1;
+}
+
+/* compares got with want for every row, reports the first difference */
+static void compare(const struct prog *p, const char *engine)
+{
+	size_t r;
+
+	for (r = 0; r < p->nrows; r++) {
+		if (p->got[r] != p->want[r]) {
+			report(p, engine, r);
+			return;
+		}
+	}
+}
+
+static void load_row(const struct prog *p, size_t r, vmcell *global)
+{
+	unsigned i;
+
+	for (i = 0; i < p->code.nglobals; i++)
+		global[i] = p->column[i][r];
+}
+
+static void check_vm(struct prog *p, vmcell *global)
+{
+	struct vmstate *vm;
+	unsigned i;
+	size_t r;
+
+	vm = vm_new(p->code.buf, p->code.len, p->code.nglobals);
+	if (!vm) {
+		fprintf(stderr, "langcheck: seed %llu: vm_new() failed\n", p->seed);
+		failed = 1;
+		return;
+	}
+	for (r = 0; r < p->nrows; r++) {
+		load_row(p, r, global);
+		for (i = 0; i < p->code.nglobals; i++)
+			vm_global_set(vm, i, global[i]);
+		vm_run(vm);
+		p->got[r] = vm_result(vm);
+	}
+	vm_free(vm);
+	compare(p, "vm_run()");
+}
+
+/* code the JIT cannot translate is not an error */
+static void check_jit(struct prog *p, vmcell *global)
+{
+	struct jit *j;
+	size_t r;
+
+	j = jit_compile(p->code.buf, p->code.len);
+	if (!j)
+		return;
+	for (r = 0; r < p->nrows; r++) {
+		load_row(p, r, global);
+		p->got[r] = jit_entry(j)(global);
+	}
+	jit_free(j);
+	compare(p, "jit");
+}
+
+static void check_batch(struct prog *p)
+{
+	struct batch *b;
+
+	b = batch_new(p->code.buf, p->code.len, p->code.nglobals);
+	if (!b || batch_run(b, (const vmcell *const *)p->column, p->code.nglobals,
+			p->got, p->nrows)) {
+		fprintf(stderr, "langcheck: seed %llu: batch_run() failed\n", p->seed);
+		failed = 1;
+	} else {
+		compare(p, "batch_run()");
+	}
+	batch_free(b);
+}
+
+static void check_pool(struct prog *p, struct pool *pool)
+{
+	struct batch *b;
+
+	b = batch_new(p->code.buf, p->code.len, p->code.nglobals);
+	if (!b || batch_run_pool(b, pool, (const vmcell *const *)p->column,
+			p->code.nglobals, p->got, p->nrows)) {
+		fprintf(stderr, "langcheck: seed %llu: batch_run_pool() failed\n", p->seed);
+		failed = 1;
+	} else {
+		compare(p, "batch_run_pool()");
+	}
+	batch_free(b);
+}
+
+static void refused(unsigned i, const char *what)
+{
+	fprintf(stderr, "langcheck: bad code %u: %s accepts it\n", i, what);
+	failed = 1;
+}
+
+/* goes through the rows setting the globals that changed from the row
+ * before, and some that did not, in a random order */
+static void check_react(struct prog *p)
+{
+	unsigned order[IDS_MAX], i, j, t;
+	struct react *r;
+	size_t row;
+
+	r = react_new(p->root, p->code.nglobals);
+	if (!r) {
+		fprintf(stderr, "langcheck: seed %llu: react_new() failed\n", p->seed);
+		failed = 1;
+		return;
+	}
+	for (i = 0; i < p->code.nglobals; i++)
+		order[i] = i;
+	for (row = 0; row < p->nrows; row++) {
+		for (i = p->code.nglobals; i > 1; i--) {
+			j = rnd(i);
+			t = order[i - 1];
+			order[i - 1] = order[j];
+			order[j] = t;
+		}
+		for (i = 0; i < p->code.nglobals; i++) {
+			vmcell v = p->column[order[i]][row];
+
+			if (!row || v != p->column[order[i]][row - 1] || !rnd(4))
+				react_set(r, order[i], v);
+		}
+		p->got[row] = react_value(r);
+	}
+	react_free(r);
+	compare(p, "react_value()");
+}
+
+/* a jump after HALT, out of the code or into the middle of an instruction.
+ * it is never reached, but the VM and batch translate every instruction. */
+static void check_bad_code(void)
+{
+	static const vmcell jump[] = { 100000000, (vmcell)-4 };
+	char name[] = "/tmp/langcheck.XXXXXX";
+	struct image_header h;
+	struct vmcode code;
+	struct vmstate *vm;
+	struct batch *b;
+	struct jit *j;
+	struct image *im;
+	unsigned i;
+	int fd;
+
+	for (i = 0; i < sizeof(jump) / sizeof(*jump); i++) {
+		memset(&code, 0, sizeof(code));
+		if (!vm_emit(&code, IPUSH, 1, 0) || !vm_emit(&code, HALT, 0, 0)
+			|| !vm_emit(&code, JMP, jump[i], 0)) {
+			fprintf(stderr, "OUT OF MEMORY!\n");
+			exit(1);
+		}
+		if (vm_verify(code.buf, code.len, 0, NULL) >= 0)
+			refused(i, "vm_verify()");
+		if ((vm = vm_new(code.buf, code.len, 0))) {
+			refused(i, "vm_new()");
+			vm_free(vm);
+		}
+		if ((b = batch_new(code.buf, code.len, 0))) {
+			refused(i, "batch_new()");
+			batch_free(b);
+		}
+		if ((j = jit_compile(code.buf, code.len))) {
+			refused(i, "jit_compile()");
+			jit_free(j);
+		}
+		/* written by hand, image_write() would not save it */
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+		h.version = IMAGE_VERSION;
+		h.header_size = sizeof(h);
+		h.cell_size = sizeof(vmcell);
+		h.code_len = code.len;
+		h.max_stack = 1;
+		fd = mkstemp(name);
+		if (fd < 0 || write(fd, &h, sizeof(h)) != sizeof(h)
+			|| write(fd, code.buf, code.len) != code.len) {
+			perror(name);
+			failed = 1;
+		} else {
+			printf("langcheck: image_open() should refuse %s:\n", name);
+			fflush(stdout);
+			if ((im = image_open(name))) {
+				refused(i, "image_open()");
+				image_close(im);
+			}
+		}
+		if (fd >= 0) {
+			close(fd);
+			unlink(name);
+		}
+		strcpy(name + strlen(name) - 6, "XXXXXX");
+		vm_code_free(&code);
+	}
+}
+
+/* source nested DEEP levels: pre, DEEP times open, leaf, DEEP times close,
+ * post. want is its value with every global 1. */
+static const struct deep {
+	const char *name;
+	const char *pre, *open, *leaf, *close, *post;
+	int run; /* the VM stack it needs is small enough to run it */
+	vmcell want;
+} deep[] = {
+	{ "if in the condition of an arm", "if (x) then (", "if (", "a",
+		") then 1 else 2", ") else 0", 1, 1 },
+	{ "if in an arm", "", "if (a) then (", "b", ") else 2", "", 1, 1 },
+	{ "left-nested sum", "", "(", "a", " + a)", "", 1, DEEP + 1 },
+	{ "right-nested sum", "", "a + (", "b", ")", "", 0, 0 },
+};
+
+static void check_deep(struct arena *arena, struct text *src, struct vmcode *code)
+{
+	vmcell global[IDS_MAX], *stack, got;
+	ast_node root;
+	unsigned i, k;
+	int depth;
+
+	for (i = 0; i < IDS_MAX; i++)
+		global[i] = 1;
+	for (i = 0; i < sizeof(deep) / sizeof(*deep); i++) {
+		const struct deep *d = &deep[i];
+
+		src->len = 0;
+		put(src, "%s", d->pre);
+		for (k = 0; k < DEEP; k++)
+			put(src, "%s", d->open);
+		put(src, "%s", d->leaf);
+		for (k = 0; k < DEEP; k++)
+			put(src, "%s", d->close);
+		put(src, "%s", d->post);
+		arena_reset(arena);
+		root = parse_buffer(arena, src->p, src->len);
+		if (!root || !compile(optimize(root), code)) {
+			fprintf(stderr, "langcheck: deep input, %s: does not compile\n", d->name);
+			failed = 1;
+			continue;
+		}
+		if (!d->run)
+			continue;
+		depth = vm_verify(code->buf, code->len, code->nglobals, NULL);
+		stack = depth >= 0 ? malloc(sizeof(*stack) * (depth ? depth : 1)) : NULL;
+		if (!stack) {
+			fprintf(stderr, "langcheck: deep input, %s: fails vm_verify()\n", d->name);
+			failed = 1;
+			continue;
+		}
+		got = vm_exec(code->buf, code->len, global, stack);
+		if (got != d->want) {
+			fprintf(stderr, "langcheck: deep input, %s: gives %u, not %u\n",
+				d->name, got, d->want);
+			failed = 1;
+		}
+		free(stack);
+	}
+}
+
+/* makes the program and rows for seed, and what vm_exec() says of them */
+static int prog_make(struct prog *p, struct arena *arena, unsigned long long seed)
+{
+	vmcell *stack, *global;
+	ast_node root;
+	unsigned i, nids;
+	size_t r;
+
+	p->seed = seed;
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+	nids = 1 + rnd(IDS_MAX);
+	p->src.len = 0;
+	expr(&p->src, 1 + rnd(rnd(8) ? 40 : 400), nids);
+	arena_reset(arena);
+	root = parse_buffer(arena, p->src.p, p->src.len);
+	if (root)
+		root = optimize(root);
+	p->root = root;
+	if (!root || !compile(root, &p->code)) {
+		fprintf(stderr, "langcheck: seed %llu: does not compile\n  %s\n", seed, p->src.p);
+		return 0;
+	}
+	p->depth = vm_verify(p->code.buf, p->code.len, p->code.nglobals, NULL);
+	if (p->depth < 0) {
+		fprintf(stderr, "langcheck: seed %llu: fails vm_verify()\n  %s\n", seed, p->src.p);
+		return 0;
+	}
+	p->nrows = 1 + rnd(rnd(16) ? 3000 : ROWS_MAX);
+	/* mostly small values so conditions go both ways */
+	for (i = 0; i < p->code.nglobals; i++) {
+		for (r = 0; r < p->nrows; r++)
+			p->column[i][r] = rnd(4) ? rnd(4) : rnd(4000000000u);
+	}
+	stack = malloc(sizeof(*stack) * (p->depth ? p->depth : 1));
+	global = malloc(sizeof(*global) * (p->code.nglobals ? p->code.nglobals : 1));
+	if (!stack || !global) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		exit(1);
+	}
+	for (r = 0; r < p->nrows; r++) {
+		load_row(p, r, global);
+		p->want[r] = vm_exec(p->code.buf, p->code.len, global, stack);
+	}
+	free(global);
+	free(stack);
+	return 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s seed] [-n programs]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct prog p;
+	struct arena *arena;
+	struct pool *pool;
+	unsigned long long seed = 1;
+	unsigned n = 500, k, i;
+	vmcell global[IDS_MAX];
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:")) != -1) {
+		switch (c) {
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	memset(&p, 0, sizeof(p));
+	/* more threads than processors still interleaves them */
+	pool = pool_new(4);
+	arena = arena_new();
+	p.column = malloc(sizeof(*p.column) * IDS_MAX);
+	p.want = malloc(sizeof(*p.want) * ROWS_MAX);
+	p.got = malloc(sizeof(*p.got) * ROWS_MAX);
+	for (i = 0; p.column && i < IDS_MAX; i++) {
+		p.column[i] = malloc(sizeof(**p.column) * ROWS_MAX);
+		if (!p.column[i])
+			break;
+	}
+	if (!pool || !arena || !p.want || !p.got || i < IDS_MAX) {
+		fprintf(stderr, "OUT OF MEMORY!\n");
+		return 1;
+	}
+
+	check_bad_code();
+	check_deep(arena, &p.src, &p.code);
+	for (k = 0; k < n; k++) {
+		if (!prog_make(&p, arena, seed + k)) {
+			failed = 1;
+			continue;
+		}
+		check_vm(&p, global);
+		check_jit(&p, global);
+		check_batch(&p);
+		check_pool(&p, pool);
+		check_react(&p);
+	}
+	printf("langcheck: %u programs %s\n", n, failed ? "FAILED" : "OK");
+
+	for (i = 0; i < IDS_MAX; i++)
+		free(p.column[i]);
+	free(p.column);
+	free(p.want);
+	free(p.got);
+	free(p.src.p);
+	vm_code_free(&p.code);
+	arena_free(arena);
+	pool_free(pool);
+	return failed;
+}
@@ -0,0 +1,370 @@
+/* liblang.c : compiles and runs programs for a host that embeds the language. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Nothing here does I/O. Errors are written to a buffer supplied by the
+ * caller. The only state kept between calls is a cache of the programs
+ * compile_string() made, shared by every thread under a lock, so a source
+ * that comes back is copied out instead of compiled again. A compiled
+ * program is never modified, so threads may share it, each running it on its
+ * own globals. The exception is a program from compile_reactive(), which
+ * keeps its globals and the values computed from them, program_set()
+ * changes it.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "ast.h"
+#include "sym.h"
+#include "tok.h"
+#include "parse.h"
+#include "opt.h"
+#include "gen.h"
+#include "mem.h"
+#include "vm.h"
+#include "react.h"
+#include "cache.h"
+#include "liblang.h"
+
+/* most programs are shallow enough to run on a stack in program_run()'s frame */
+#define RUN_STACK 64
+#define CACHE_SIZE 1024 /* programs compile_string() remembers */
+
+/* the cache outlives any one call, so it is always allocated with malloc()
+ * whatever allocator the caller passes. NULL until first used, or if there
+ * was no memory for it. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache *cache;
+static int cache_made;
+
+/* allocated as one block: the structure, the table of names, the code and
+ * then the names themselves. */
+struct program {
+	struct mem_allocator alloc;
+	int has_alloc;
+	unsigned nglobals;
+	unsigned max_stack; /* from vm_verify() */
+	struct react *react; /* compile_reactive() only */
+	const char **name; /* by global slot */
+	const unsigned char *code;
+	unsigned code_len;
+};
+
+/* appends s to the string in err, truncating it to fit */
+static void err_put(char *err, size_t err_len, const char *s)
+{
+	size_t n = strlen(err), len = strlen(s);
+
+	if (n + len >= err_len)
+		len = err_len - n - 1;
+	memcpy(err + n, s, len);
+	err[n + len] = 0;
+}
+
+static void err_num(char *err, size_t err_len, unsigned v)
+{
+	char buf[16], *p = buf + sizeof(buf);
+
+	*--p = 0;
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	err_put(err, err_len, p);
+}
+
+/* "line 3, column 7: reason", or just the reason without a position */
+static void err_set(char *err, size_t err_len, const char *reason, int line, int ofs)
+{
+	if (!err_len)
+		return;
+	err[0] = 0;
+	if (line > 0) {
+		err_put(err, err_len, "line ");
+		err_num(err, err_len, line);
+		err_put(err, err_len, ", column ");
+		err_num(err, err_len, ofs);
+		err_put(err, err_len, ": ");
+	}
+	err_put(err, err_len, reason);
+}
+
+/* name holds the identifier of each global slot */
+static struct program *program_new(const struct vmcode *code, unsigned max_stack,
+	const char *const *name, const struct mem_allocator *alloc)
+{
+	struct program *p;
+	size_t size, len;
+	unsigned i;
+	char *s;
+
+	size = sizeof(*p) + sizeof(*p->name) * code->nglobals + code->len;
+	for (i = 0; i < code->nglobals; i++)
+		size += strlen(name[i]) + 1;
+	p = mem_alloc(size);
+	if (p) {
+		p->has_alloc = alloc != NULL;
+		if (alloc)
+			p->alloc = *alloc;
+		else
+			memset(&p->alloc, 0, sizeof(p->alloc));
+		p->nglobals = code->nglobals;
+		p->max_stack = max_stack;
+		p->react = NULL;
+		p->name = (const char **)(p + 1);
+		p->code = (unsigned char *)(p->name + code->nglobals);
+		p->code_len = code->len;
+		memcpy((unsigned char *)p->code, code->buf, code->len);
+		s = (char *)p->code + code->len;
+		for (i = 0; i < code->nglobals; i++) {
+			len = strlen(name[i]) + 1;
+			p->name[i] = memcpy(s, name[i], len);
+			s += len;
+		}
+	}
+	return p;
+}
+
+/* the identifiers st has seen, by global slot, in a block to mem_free() */
+static const char **names(struct pstate *st)
+{
+	const struct symbol **sym;
+	const char **name;
+	unsigned i, n = sym_count(st);
+
+	sym = mem_calloc(n + 1, sizeof(*sym));
+	name = mem_calloc(n + 1, sizeof(*name));
+	if (sym && name) {
+		sym_list(st, sym);
+		for (i = 0; i < n; i++)
+			name[i] = sym[i]->name;
+	} else {
+		mem_free(name);
+		name = NULL;
+	}
+	mem_free(sym);
+	return name;
+}
+
+/* a copy of the cached program for src, allocated with alloc, if there is
+ * one. returns 0 on a miss. */
+static int cache_get(const char *src, size_t len, const struct mem_allocator *alloc,
+	struct program **p)
+{
+	const struct mem_allocator *old = mem_use(NULL);
+	const struct cached *hit = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache_made) {
+		cache = cache_new(CACHE_SIZE);
+		cache_made = 1;
+	}
+	if (cache)
+		hit = cache_find(cache, src, len);
+	if (hit) {
+		mem_use(alloc);
+		*p = program_new(&hit->code, hit->max_stack, hit->name, alloc);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	mem_use(old);
+	return hit != NULL;
+}
+
+static void cache_put(const char *src, size_t len, const struct vmcode *code,
+	const char *const *name)
+{
+	const struct mem_allocator *old = mem_use(NULL);
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache)
+		cache_add(cache, src, len, code, name);
+	pthread_mutex_unlock(&cache_lock);
+	mem_use(old);
+}
+
+/* what the cache used by compile_string() has done so far */
+void program_cache_stats(struct cache_stats *stats)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (cache)
+		cache_stats(cache, stats);
+	else
+		memset(stats, 0, sizeof(*stats));
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* compile_string(), with reactive set the tree is also kept for
+ * program_set() and program_value() */
+static struct program *compile_src(const char *src, size_t len, const struct mem_allocator *alloc,
+	char *err, size_t err_len, int reactive)
+{
+	const struct mem_allocator *old = mem_use(alloc);
+	struct vmcode code = { NULL, 0, 0, 0, NULL, 0, 0 };
+	struct program *p = NULL;
+	struct pstate *st = NULL;
+	struct arena *arena;
+	const char *reason, **name = NULL;
+	ast_node root;
+	int line = 0, ofs = 0, depth;
+
+	arena = arena_new();
+	if (arena)
+		st = pstate_new_buffer(arena, src, len);
+	if (!st) {
+		err_set(err, err_len, "out of memory", 0, 0);
+		goto out;
+	}
+	root = parse_pstate(st);
+	if (!root) {
+		reason = error_msg(st, &line, &ofs);
+		err_set(err, err_len, reason ? reason : "syntax error", line, ofs);
+		goto out;
+	}
+	root = optimize(root);
+	if (!compile(root, &code)) {
+		err_set(err, err_len, "out of memory", 0, 0);
+		goto out;
+	}
+	/* the VM does no checking while running */
+	depth = vm_verify(code.buf, code.len, code.nglobals, NULL);
+	if (depth < 0) {
+		err_set(err, err_len, "expression is nested too deeply", 0, 0);
+		goto out;
+	}
+	name = names(st);
+	if (name)
+		p = program_new(&code, depth, name, alloc);
+	if (p && !reactive)
+		cache_put(src, len, &code, name);
+	if (p && reactive) {
+		p->react = react_new(root, code.nglobals);
+		if (!p->react) {
+			mem_free(p);
+			p = NULL;
+		}
+	}
+	if (!p)
+		err_set(err, err_len, "out of memory", 0, 0);
+out:
+	mem_free(name);
+	vm_code_free(&code);
+	pstate_free(st);
+	arena_free(arena);
+	mem_use(old);
+	return p;
+}
+
+/* compiles len bytes of src, or copies the program out of the cache if the
+ * same source was compiled before. the program is allocated with alloc, or
+ * with malloc() if it is NULL. returns NULL after writing the reason to err. */
+struct program *compile_string(const char *src, size_t len, const struct mem_allocator *alloc,
+	char *err, size_t err_len)
+{
+	struct program *p = NULL;
+
+	if (cache_get(src, len, alloc, &p)) {
+		if (!p)
+			err_set(err, err_len, "out of memory", 0, 0);
+		return p;
+	}
+	return compile_src(src, len, alloc, err, err_len, 0);
+}
+
+/* compile_string() for a program that stays resident while a few of its
+ * globals change between evaluations. it keeps its own globals, all 0 to
+ * begin with, and program_value() only recomputes the parts of the
+ * expression that depend on the ones program_set() changed. */
+struct program *compile_reactive(const char *src, size_t len, const struct mem_allocator *alloc,
+	char *err, size_t err_len)
+{
+	return compile_src(src, len, alloc, err, err_len, 1);
+}
+
+void program_free(struct program *p)
+{
+	const struct mem_allocator *old;
+	struct mem_allocator alloc;
+
+	if (!p)
+		return;
+	/* the copy stays valid while p is being freed */
+	alloc = p->alloc;
+	old = mem_use(p->has_alloc ? &alloc : NULL);
+	react_free(p->react);
+	mem_free(p);
+	mem_use(old);
+}
+
+/* the globals array passed to program_run() needs this many entries */
+unsigned program_globals(const struct program *p)
+{
+	return p->nglobals;
+}
+
+/* global slot of the identifier name, or -1 if the program does not use it */
+int program_global(const struct program *p, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < p->nglobals; i++) {
+		if (!strcmp(p->name[i], name))
+			return i;
+	}
+	return -1;
+}
+
+/* evaluates p with the given globals. returns 0 and stores the value in
+ * result on success, -1 if out of memory. */
+int program_run(const struct program *p, vmcell *globals, vmcell *result)
+{
+	const struct mem_allocator *old;
+	struct mem_allocator alloc;
+	vmcell local[RUN_STACK], *stack;
+	int ret = -1;
+
+	if (p->max_stack <= RUN_STACK) {
+		*result = vm_exec(p->code, p->code_len, globals, local);
+		return 0;
+	}
+	/* deep programs get a stack from the allocator they were compiled with */
+	alloc = p->alloc;
+	old = mem_use(p->has_alloc ? &alloc : NULL);
+	stack = mem_alloc(sizeof(*stack) * p->max_stack);
+	if (stack) {
+		*result = vm_exec(p->code, p->code_len, globals, stack);
+		ret = 0;
+	}
+	mem_free(stack);
+	mem_use(old);
+	return ret;
+}
+
+/* sets global slot i of a program from compile_reactive(), slots it does not
+ * have are ignored. */
+void program_set(struct program *p, unsigned i, vmcell v)
+{
+	if (p->react)
+		react_set(p->react, i, v);
+}
+
+/* the value of a program from compile_reactive() for its globals as they are
+ * now, 0 for any other program. */
+vmcell program_value(struct program *p)
+{
+	return p->react ? react_value(p->react) : 0;
+}
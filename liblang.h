@@ -0,0 +1,20 @@
+#ifndef LIBLANG_H
+#define LIBLANG_H
+#include <stddef.h>
+#include "mem.h"
+#include "vm.h"
+#include "cache.h"
+struct program;
+
+struct program *compile_string(const char *src, size_t len, const struct mem_allocator *alloc,
+	char *err, size_t err_len);
+void program_free(struct program *p);
+unsigned program_globals(const struct program *p);
+int program_global(const struct program *p, const char *name);
+int program_run(const struct program *p, vmcell *globals, vmcell *result);
+struct program *compile_reactive(const char *src, size_t len, const struct mem_allocator *alloc,
+	char *err, size_t err_len);
+void program_set(struct program *p, unsigned i, vmcell v);
+vmcell program_value(struct program *p);
+void program_cache_stats(struct cache_stats *stats);
+#endif
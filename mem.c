@@ -0,0 +1,75 @@
+/* mem.c : allocation hooks that let an embedder supply its own allocator. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+/* NULL means the C library. each thread has its own, so a library call can
+ * switch it for the duration of the call without affecting other threads. */
+static __thread const struct mem_allocator *cur;
+
+/* route this thread's allocations to a, or back to malloc() if a is NULL.
+ * returns the previous allocator, for restoring it. memory must be freed
+ * while the allocator that provided it is current. */
+const struct mem_allocator *mem_use(const struct mem_allocator *a)
+{
+	const struct mem_allocator *old = cur;
+
+	cur = a;
+	return old;
+}
+
+void *mem_alloc(size_t size)
+{
+	if (cur)
+		return cur->fn(cur->ctx, NULL, size ? size : 1);
+	return malloc(size);
+}
+
+/* zero filled, like calloc() */
+void *mem_calloc(size_t n, size_t size)
+{
+	void *p;
+
+	if (!cur)
+		return calloc(n, size);
+	if (size && n > (size_t)-1 / size)
+		return NULL;
+	p = mem_alloc(n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+	if (cur)
+		return cur->fn(cur->ctx, ptr, size ? size : 1);
+	return realloc(ptr, size);
+}
+
+void mem_free(void *ptr)
+{
+	if (!ptr)
+		return;
+	if (cur)
+		cur->fn(cur->ctx, ptr, 0);
+	else
+		free(ptr);
+}
@@ -0,0 +1,17 @@
+#ifndef MEM_H
+#define MEM_H
+#include <stddef.h>
+
+/* an allocator is a single realloc()-like function. a size of 0 frees ptr,
+ * otherwise ptr is NULL for a new block. NULL is returned on failure. */
+struct mem_allocator {
+	void *(*fn)(void *ctx, void *ptr, size_t size);
+	void *ctx;
+};
+
+const struct mem_allocator *mem_use(const struct mem_allocator *a);
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t n, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+#endif
@@ -0,0 +1,138 @@
+/* opt.c : constant folding and algebraic simplification of the ast. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ast.h"
+#include "vm.h"
+#include "gen.h"
+#include "opt.h"
+#include "stats.h"
+#include "trace.h"
+
+static int is_num(ast_node n, vmcell v)
+{
+	return n->type == N_NUM && (vmcell)n->num == v;
+}
+
+static ast_node make_num(ast_node n, vmcell v)
+{
+	n->type = N_NUM;
+	n->num = v;
+	return n;
+}
+
+/* expressions have no side effects, so any operand may be dropped. */
+static ast_node simplify_2op(ast_node n)
+{
+	ast_node l = n->left, r = n->right;
+
+	if (l->type == N_NUM && r->type == N_NUM)
+		return make_num(n, vm_arith(gen_op(n->op), l->num, r->num));
+
+	switch (n->op) {
+	case O_ADD:
+		if (is_num(l, 0))
+			return r;
+		if (is_num(r, 0))
+			return l;
+		break;
+	case O_SUB:
+		if (is_num(r, 0))
+			return l;
+		break;
+	case O_MUL:
+		if (is_num(l, 0) || is_num(r, 0))
+			return make_num(n, 0);
+		if (is_num(l, 1))
+			return r;
+		if (is_num(r, 1))
+			return l;
+		break;
+	case O_DIV:
+		if (is_num(r, 0) || is_num(r, 1))
+			return l;
+		if (is_num(l, 0)) /* 0/x is 0, even for x=0 */
+			return make_num(n, 0);
+		break;
+	case O_ERR:
+		break;
+	}
+	return n;
+}
+
+static ast_node simplify_cond(ast_node n)
+{
+	if (n->arg[0] && n->arg[0] == n->arg[1])
+		return n->arg[0]; /* shared by the parser, both arms are the same */
+	if (n->left->type == N_NUM) {
+		ast_node taken = (vmcell)n->left->num ? n->arg[0] : n->arg[1];
+
+		TRACE_FMT("constant condition %ld\n", n->left->num);
+		if (taken)
+			return taken;
+	}
+	return n;
+}
+
+/* children are simplified before their parent, each frame's slot is the
+ * pointer to the node in its parent. if the stack cannot grow the tree is
+ * left partly simplified, which is still correct. */
+static ast_node opt(ast_node root)
+{
+	struct ast_stack s;
+	struct ast_frame *f;
+	ast_node n, *child;
+
+	ast_stack_init(&s);
+	f = root ? ast_push(&s, root, 0) : NULL;
+	if (f)
+		f->slot = &root;
+	while (s.n) {
+		f = &s.frame[s.n - 1];
+		n = f->node;
+		child = ast_child(n, f->step++);
+		if (child) {
+			if (*child) {
+				f = ast_push(&s, *child, 0);
+				if (!f)
+					break;
+				f->slot = child;
+			}
+			continue;
+		}
+		if (n->type == N_2OP)
+			n = simplify_2op(n);
+		else if (n->type == N_COND)
+			n = simplify_cond(n);
+		*f->slot = n;
+		s.n--;
+	}
+	ast_stack_free(&s);
+	return root;
+}
+
+/* returns the replacement for n, which may be n itself or one of its children. */
+ast_node optimize(ast_node n)
+{
+	unsigned long long start = stats_clock();
+
+	n = opt(n);
+	stats_phase(PHASE_OPTIMIZE, start);
+	return n;
+}
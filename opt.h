@@ -0,0 +1,5 @@
+#ifndef OPT_H
+#define OPT_H
+#include "ast.h"
+ast_node optimize(ast_node root);
+#endif
@@ -40,8 +40,16 @@
 #include "tok.h"
 #include "trace.h"
 #include "parse.h"
+#include "stats.h"
 
-ast_node expr(struct pstate *st); /* forward */
+/* what an open frame of the parse is waiting for */
+enum {
+	P_OP, /* the right operand of the N_2OP node */
+	P_PAREN, /* ")" */
+	P_IF_COND, /* ")" "then" */
+	P_IF_THEN, /* "else" */
+	P_IF_ELSE, /* the end of the N_COND node */
+};
 
 static enum ast_op op(enum token t)
 {
@@ -55,203 +63,207 @@ static enum ast_op op(enum token t)
 	}
 }
 
-/* number ::= [0-9]+
- */
-ast_node number(struct pstate *st)
+static int prec(enum ast_op op)
 {
-	ast_node n;
-
-	TRACE;
-	n = ast_node_new(st, N_NUM);
-	n->num = num_buf(st);
-	tok_next(st);
-	return n;
+	return op == O_MUL || op == O_DIV ? 2 : 1;
 }
 
-/* identifier ::= [A-Za-z_][A-Za-z0-9_]*
- */
-ast_node identifier(struct pstate *st)
+/* consume token t, or report reason */
+static int expect(struct pstate *st, enum token t, const char *reason)
 {
-	ast_node n;
-
-	TRACE;
-	n = ast_node_new(st, N_VAR);
-	n->id = strdup(id_buf(st));
+	if (tok_cur(st) != (int)t) {
+		TRACE_FMT("ERROR:tok=%d\n", tok_cur(st));
+		error(st, reason);
+		return 0;
+	}
 	tok_next(st);
-	return n;
+	return 1;
 }
 
-/* ExprParen ::= "(" Expr ")"
+/* number ::= [0-9]+
  */
-ast_node paren_expr(struct pstate *st)
+static ast_node number(struct pstate *st)
 {
 	ast_node n;
 
 	TRACE;
-	tok_next(st);
-	n = expr(st);
+	n = ast_node_new(st, N_NUM);
 	if (!n)
 		return NULL;
-	TRACE;
-	if (tok_cur(st) != T_RIGHT_PAREN) {
-		TRACE;
-		TRACE_FMT("ERROR:tok=%d\n", tok_cur(st));
-		error(st, "missing parentheses");
-		ast_node_free(n);
-		return NULL;
-	}
+	n->num = num_buf(st);
 	tok_next(st);
 	return n;
 }
 
-/* Factor ::= identifier | number | "(" Expr ")"
- */
-ast_node factor(struct pstate *st)
-{
-	TRACE;
-	if (tok_cur(st) == T_IDENTIFIER) {
-		return identifier(st);
-	} else if (tok_cur(st) == T_NUMBER) {
-		return number(st);
-	} else if (tok_cur(st) == T_LEFT_PAREN) { /* "(" Expr ")" */
-		return paren_expr(st);
-	}
-	return NULL; /* ignore anything else as not a match */
-}
-
-ast_node factor_required(struct pstate *st)
-{
-	ast_node n = factor(st);
-
-	if (!n)
-		error(st, "missing identifier or number");
-	return n;
-}
-
-/* Term ::= Factor { "*" Factor }
+/* identifier ::= [A-Za-z_][A-Za-z0-9_]*
  */
-ast_node term(struct pstate *st)
+static ast_node identifier(struct pstate *st)
 {
-	ast_node left;
+	ast_node n;
 
 	TRACE;
-	left = factor(st);
-	if (!left)
+	n = ast_node_new(st, N_VAR);
+	if (!n)
 		return NULL;
-	while (tok_cur(st) == T_MUL || tok_cur(st) == T_DIV) {
-		ast_node new = ast_node_new(st, N_2OP);
-
-		new->op = op(tok_cur(st));
-		tok_next(st);
-		new->left = left;
-		new->right = factor_required(st);
-		if (!new->right) {
-			ast_node_free(new);
-			return NULL;
-		}
-		left = new; /* recurse left */
-	}
-
-	return left;
+	n->id = id_name(st);
+	n->sym = id_sym(st);
+	tok_next(st);
+	return n;
 }
 
-ast_node expr_term(struct pstate *st)
+/* Expr, by precedence climbing. instead of recursing, every operator,
+ * parenthesis and if-expression still waiting for its operands is pushed on
+ * an explicit stack, so the nesting depth is only limited by memory. unless
+ * the pstate has sharing off, each node is hash-consed as soon as it is
+ * complete and repeated subexpressions come out as one shared node. */
+static ast_node expr(struct pstate *st)
 {
-
-	ast_node left;
-
-	TRACE;
-	/* TODO: check for T_MINUS to find unary +/- */
-	left = term(st);
-	TRACE_FMT("%s():%d:tok=%d\n", __func__, __LINE__, tok_cur(st));
-	if (!left)
-		return NULL;
-	while (tok_cur(st) == T_PLUS || tok_cur(st) == T_MINUS) {
-		ast_node new = ast_node_new(st, N_2OP);
-
+	struct ast_stack s;
+	struct ast_cons cons;
+	struct ast_frame *f;
+	ast_node n, val = NULL;
+	enum ast_op o;
+	int share;
+
+	ast_stack_init(&s);
+	ast_cons_init(&cons);
+	share = pstate_shares(st);
+start: /* Expr ::= IfExpr | ExprTerm */
+	if (tok_cur(st) == T_IF) {
 		TRACE;
-		new->op = op(tok_cur(st));
+		n = ast_node_new(st, N_COND);
+		if (!n)
+			goto fail;
 		tok_next(st);
-		new->left = left;
-		new->right = term(st);
-		if (!new->right) {
-			error(st, "missing factor");
-			ast_node_free(new);
-			return NULL;
-		}
-		left = new; /* recurse left */
+		if (!expect(st, T_LEFT_PAREN, "missing parentheses"))
+			goto fail;
+		if (!ast_push(&s, n, P_IF_COND))
+			goto nomem;
+		goto start;
 	}
-
-	return left;
-}
-
-/* IfExpr ::= "if" ParenExpr "then" Expr "else" Expr
- */
-ast_node if_expr(struct pstate *st)
-{
-	ast_node n;
-
-
-	TRACE;
-	if (tok_cur(st) != T_IF) {
-		error(st, "missing 'if'");
-		return NULL;
+operand: /* Factor ::= identifier | number | "(" Expr ")" */
+	switch (tok_cur(st)) {
+	case T_IDENTIFIER:
+		val = identifier(st);
+		break;
+	case T_NUMBER:
+		val = number(st);
+		break;
+	case T_LEFT_PAREN:
+		tok_next(st);
+		if (!ast_push(&s, NULL, P_PAREN))
+			goto nomem;
+		goto start;
+	default:
+		error(st, "missing identifier or number");
+		goto fail;
 	}
-	tok_next(st);
-
-	n = ast_node_new(st, N_COND);
-	n->left = paren_expr(st); /* condition */
-	TRACE;
-	if (tok_cur(st) != T_THEN) {
-		error(st, "missing 'then'");
-		ast_node_free(n);
-		return NULL;
+	if (!val)
+		goto fail;
+	if (share)
+		val = ast_cons(&cons, val);
+operator: /* { op Factor }, finishing operators that bind at least as tightly */
+	o = op(tok_cur(st));
+	while (s.n && (f = &s.frame[s.n - 1])->step == P_OP
+		&& (o == O_ERR || prec(f->node->op) >= prec(o))) {
+		f->node->right = val;
+		val = share ? ast_cons(&cons, f->node) : f->node;
+		s.n--;
 	}
-
-	tok_next(st);
-	n->arg[0] = expr(st); /* then */
-
-	if (tok_cur(st) == T_ELSE) {
+	if (o != O_ERR) {
+		n = ast_node_new(st, N_2OP);
+		if (!n)
+			goto fail;
+		n->op = o;
+		n->left = val;
 		tok_next(st);
-		n->arg[1] = expr(st); /* else */
-	} else {
-		n->arg[1] = NULL;
+		if (!ast_push(&s, n, P_OP))
+			goto nomem;
+		goto operand;
 	}
-	TRACE;
-	return n;
-}
-
-/* Expr ::= Term { "+" Term }
- */
-ast_node expr(struct pstate *st)
-{
-	TRACE;
-	if (tok_cur(st) == T_IF) {
-		TRACE;
-		return if_expr(st);
-	} else {
-		TRACE;
-		return expr_term(st);
+	/* val is a whole Expr, pass it to whatever it was parsed for */
+	while (s.n) {
+		f = &s.frame[s.n - 1];
+		switch (f->step) {
+		case P_PAREN:
+			s.n--;
+			if (!expect(st, T_RIGHT_PAREN, "missing parentheses"))
+				goto fail;
+			goto operator;
+		case P_IF_COND:
+			if (!expect(st, T_RIGHT_PAREN, "missing parentheses")
+				|| !expect(st, T_THEN, "missing 'then'"))
+				goto fail;
+			f->node->left = val;
+			f->step = P_IF_THEN;
+			goto start;
+		case P_IF_THEN:
+			if (!expect(st, T_ELSE, "missing 'else'"))
+				goto fail;
+			f->node->arg[0] = val;
+			f->step = P_IF_ELSE;
+			goto start;
+		case P_IF_ELSE:
+			f->node->arg[1] = val;
+			val = share ? ast_cons(&cons, f->node) : f->node;
+			s.n--;
+			break;
+		}
 	}
+	ast_cons_free(&cons);
+	ast_stack_free(&s);
+	return val;
+nomem:
+	error(st, "out of memory");
+fail:
+	ast_cons_free(&cons);
+	ast_stack_free(&s);
+	return NULL;
 }
 
-ast_node parse(void)
+/* parse all of st's input. st is left for the caller to reset or free. */
+ast_node parse_pstate(struct pstate *st)
 {
-	struct pstate *st;
+	unsigned long long start = stats_clock();
 	ast_node root;
 
-	st = pstate_new();
+	if (!st)
+		return NULL;
 	root = expr(st);
 	discard_whitespace(st);
 	TRACE_FMT("final token=%d\n", tok_cur(st));
 	if (tok_cur(st) != T_EOF)
 		error(st, "trailing garbage");
 	TRACE_FMT("DONE!\n");
-	if (last_error(st)) {
-		pstate_free(st);
+	stats_phase(PHASE_PARSE, start);
+	if (last_error(st))
 		return NULL;
-	}
+	return root;
+}
+
+static ast_node parse_once(struct pstate *st)
+{
+	ast_node root = parse_pstate(st);
 
+	if (st)
+		error_print(st);
 	pstate_free(st);
 	return root;
 }
+
+/* parse standard input, the returned tree is owned by arena. */
+ast_node parse(struct arena *arena)
+{
+	return parse_once(pstate_new(arena));
+}
+
+/* parse len bytes of buf, the buffer need not be preserved afterwards. */
+ast_node parse_buffer(struct arena *arena, const char *buf, size_t len)
+{
+	return parse_once(pstate_new_buffer(arena, buf, len));
+}
+
+ast_node parse_file(struct arena *arena, const char *filename)
+{
+	return parse_once(pstate_new_file(arena, filename));
+}
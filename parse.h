@@ -1,5 +1,11 @@
-#ifndef PARSE_H
-#define PARSE_H
-#include "ast.h"
-ast_node parse(void);
-#endif
+#ifndef PARSE_H
+#define PARSE_H
+#include <stddef.h>
+#include "ast.h"
+struct arena;
+struct pstate;
+ast_node parse(struct arena *arena);
+ast_node parse_buffer(struct arena *arena, const char *buf, size_t len);
+ast_node parse_file(struct arena *arena, const char *filename);
+ast_node parse_pstate(struct pstate *st);
+#endif
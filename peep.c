@@ -0,0 +1,308 @@
+/* peep.c : peephole optimizer for the generated bytecode. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+#include "peep.h"
+#include "mem.h"
+#include "trace.h"
+
+/* instructions are kept in their original order, deleting one only clears
+ * its live flag. jump targets are instruction numbers, a jump to a deleted
+ * instruction falls through to the next live one. */
+struct peep {
+	struct vminsn *insn;
+	unsigned *target; /* jumps only */
+	unsigned char *live;
+	unsigned char *reached;
+	unsigned char *targeted; /* as of the start of the current pass */
+	unsigned *slot; /* new number of each temp slot, ~0u if none reads it */
+	unsigned n;
+};
+
+static int is_jump(enum vmop op)
+{
+	return op == JZ || op == JNZ || op == JMP;
+}
+
+/* first live instruction at or after i, or n */
+static unsigned resolve(const struct peep *p, unsigned i)
+{
+	while (i < p->n && !p->live[i])
+		i++;
+	return i;
+}
+
+/* follow JMP chains, giving up on cycles. every JMP on the way is pointed
+ * straight at the end, so nested chains are only walked once. */
+static unsigned thread(struct peep *p, unsigned i)
+{
+	unsigned hops, dst, next;
+
+	dst = resolve(p, i);
+	for (hops = 0; hops < p->n && dst < p->n && p->insn[dst].op == JMP; hops++)
+		dst = resolve(p, p->target[dst]);
+	for (i = resolve(p, i); hops-- && i != dst; i = next) {
+		next = resolve(p, p->target[i]);
+		p->target[i] = dst;
+	}
+	return dst;
+}
+
+static void find_targets(struct peep *p)
+{
+	unsigned i;
+
+	for (i = 0; i < p->n; i++)
+		p->targeted[i] = 0;
+	for (i = 0; i < p->n; i++) {
+		if (p->live[i] && is_jump(p->insn[i].op)) {
+			unsigned dst = resolve(p, p->target[i]);
+
+			if (dst < p->n)
+				p->targeted[dst] = 1;
+		}
+	}
+}
+
+static int pass_jumps(struct peep *p)
+{
+	int changed = 0;
+	unsigned i, next, dst;
+
+	find_targets(p);
+	for (i = 0; i < p->n; i++) {
+		if (!p->live[i] || !is_jump(p->insn[i].op))
+			continue;
+		dst = thread(p, p->target[i]);
+		if (dst != resolve(p, p->target[i])) {
+			p->target[i] = dst;
+			changed = 1;
+		}
+		next = resolve(p, i + 1);
+		if (dst == next) {
+			/* jump to the next instruction */
+			if (p->insn[i].op == JMP) {
+				p->live[i] = 0;
+			} else {
+				p->insn[i].op = IPOP;
+			}
+			changed = 1;
+		} else if (p->insn[i].op == JMP && dst < p->n && p->insn[dst].op == HALT) {
+			p->insn[i].op = HALT;
+			changed = 1;
+		} else if (p->insn[i].op != JMP && next < p->n && p->insn[next].op == JMP
+			&& dst == resolve(p, next + 1)) {
+			/* JZ L1; JMP L2; L1: becomes JNZ L2 */
+			p->insn[i].op = p->insn[i].op == JZ ? JNZ : JZ;
+			p->target[i] = p->target[next];
+			if (!p->targeted[next])
+				p->live[next] = 0;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* a value pushed and immediately dropped */
+static int pass_push_pop(struct peep *p)
+{
+	int changed = 0;
+	unsigned i, next;
+
+	find_targets(p);
+	for (i = 0; i < p->n; i++) {
+		if (!p->live[i] || (p->insn[i].op != IPUSH && p->insn[i].op != IFETCH))
+			continue;
+		next = resolve(p, i + 1);
+		if (next < p->n && p->insn[next].op == IPOP && !p->targeted[next]) {
+			p->live[i] = p->live[next] = 0;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* a temp that is never read back needs no stores and no room. the temps
+ * still read are numbered again from 0 and TALLOC makes only that many, or
+ * goes away if there are none. slots are numbered from 0, there cannot be
+ * more worth tracking than instructions. */
+static int pass_dead_temps(struct peep *p)
+{
+	struct vminsn *in;
+	unsigned i, used = 0;
+	int changed = 0;
+
+	for (i = 0; i < p->n; i++)
+		p->slot[i] = ~0u;
+	for (i = 0; i < p->n; i++) {
+		in = &p->insn[i];
+		if (!p->live[i] || (in->op != TFETCH && in->op != TSTORE))
+			continue;
+		if (in->arg >= p->n)
+			return 0;
+		if (in->op == TFETCH)
+			p->slot[in->arg] = 0;
+	}
+	for (i = 0; i < p->n; i++) {
+		if (p->slot[i] != ~0u)
+			p->slot[i] = used++;
+	}
+	for (i = 0; i < p->n; i++) {
+		in = &p->insn[i];
+		if (!p->live[i])
+			continue;
+		if (in->op == TALLOC && in->arg > used) {
+			in->arg = used;
+			p->live[i] = used > 0;
+			changed = 1;
+		} else if ((in->op == TFETCH || in->op == TSTORE) && p->slot[in->arg] != in->arg) {
+			in->arg = p->slot[in->arg];
+			p->live[i] = in->arg != ~0u;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+static int pass_unreachable(struct peep *p)
+{
+	unsigned *work, top = 0, i;
+	int changed = 0;
+
+	work = mem_alloc(sizeof(*work) * (p->n + 1));
+	if (!work)
+		return 0;
+	for (i = 0; i < p->n; i++)
+		p->reached[i] = 0;
+	i = resolve(p, 0);
+	if (i < p->n)
+		work[top++] = i;
+	while (top) {
+		i = work[--top];
+		if (p->reached[i])
+			continue;
+		p->reached[i] = 1;
+		if (is_jump(p->insn[i].op)) {
+			unsigned dst = resolve(p, p->target[i]);
+
+			if (dst < p->n && !p->reached[dst])
+				work[top++] = dst;
+		}
+		if (p->insn[i].op != JMP && p->insn[i].op != HALT) {
+			unsigned next = resolve(p, i + 1);
+
+			if (next < p->n && !p->reached[next])
+				work[top++] = next;
+		}
+	}
+	for (i = 0; i < p->n; i++) {
+		if (p->live[i] && !p->reached[i]) {
+			p->live[i] = 0;
+			changed = 1;
+		}
+	}
+	mem_free(work);
+	return changed;
+}
+
+/* encode the live instructions into out. a jump's size depends on the
+ * distance to its destination and the distance on the size of the jumps in
+ * between, so sizes are grown until every offset fits. they never shrink,
+ * which guarantees this stops. returns 0 if out of memory. */
+static int relayout(struct peep *p, struct vmcode *out, unsigned *pcmap)
+{
+	unsigned *pc, *len, i;
+	int changed, ok = 0;
+
+	pc = mem_alloc(sizeof(*pc) * (p->n + 1));
+	len = mem_alloc(sizeof(*len) * (p->n + 1));
+	if (!pc || !len)
+		goto out;
+	for (i = 0; i < p->n; i++)
+		len[i] = p->live[i] ? vm_insn_len(p->insn[i].op, p->insn[i].arg) : 0;
+	do {
+		changed = 0;
+		pc[0] = 0;
+		for (i = 0; i < p->n; i++)
+			pc[i + 1] = pc[i] + len[i];
+		for (i = 0; i < p->n; i++) {
+			unsigned need;
+
+			if (!p->live[i] || !is_jump(p->insn[i].op))
+				continue;
+			p->insn[i].arg = pc[resolve(p, p->target[i])] - pc[i + 1];
+			need = vm_insn_len(p->insn[i].op, p->insn[i].arg);
+			if (need > len[i]) {
+				len[i] = need;
+				changed = 1;
+			}
+		}
+	} while (changed);
+	for (i = 0; i < p->n; i++) {
+		if (pcmap)
+			pcmap[i] = p->live[i] ? out->len : ~0u;
+		if (p->live[i] && !vm_emit(out, p->insn[i].op, p->insn[i].arg, len[i]))
+			goto out;
+	}
+	ok = 1;
+out:
+	mem_free(len);
+	mem_free(pc);
+	return ok;
+}
+
+/* optimizes a list of n instructions whose jump targets are instruction
+ * numbers, and appends the encoded result to out. if pcmap is not NULL it
+ * receives the pc of each instruction, or ~0u for deleted ones.
+ * returns 0 on failure. */
+int peephole(struct vminsn *insn, unsigned n, struct vmcode *out, unsigned *pcmap)
+{
+	struct peep p;
+	unsigned i;
+	int ok = 0;
+
+	p.n = n;
+	p.insn = insn;
+	p.target = mem_alloc(sizeof(*p.target) * (n + 1));
+	p.live = mem_alloc(n + 1);
+	p.reached = mem_alloc(n + 1);
+	p.targeted = mem_alloc(n + 1);
+	p.slot = mem_alloc(sizeof(*p.slot) * (n + 1));
+	if (!p.target || !p.live || !p.reached || !p.targeted || !p.slot)
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (is_jump(insn[i].op) && insn[i].target > n)
+			goto out;
+		p.target[i] = insn[i].target;
+		p.live[i] = 1;
+	}
+
+	while (pass_jumps(&p) | pass_push_pop(&p) | pass_dead_temps(&p) | pass_unreachable(&p))
+		;
+	ok = relayout(&p, out, pcmap);
+	TRACE_FMT("peephole %u instructions -> %u bytes\n", n, out->len);
+out:
+	mem_free(p.slot);
+	mem_free(p.targeted);
+	mem_free(p.reached);
+	mem_free(p.live);
+	mem_free(p.target);
+	return ok;
+}
@@ -0,0 +1,5 @@
+#ifndef PEEP_H
+#define PEEP_H
+#include "vm.h"
+int peephole(struct vminsn *insn, unsigned n, struct vmcode *out, unsigned *pcmap);
+#endif
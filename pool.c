@@ -0,0 +1,243 @@
+/* pool.c : fixed set of worker threads that split up ranges of work. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A job is cut into chunks of grain items. Each worker starts with an equal
+ * share of the chunks and takes them one at a time from the front of its own
+ * range. A worker that runs dry steals the back half of the largest range
+ * left, so uneven chunks still keep every thread busy until the end.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock; /* protects lo and hi */
+	size_t lo, hi; /* chunks not yet taken */
+	struct pool *pool;
+	unsigned id;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned generation; /* bumped for every job, and to shut down */
+	unsigned running; /* workers still busy with the current job */
+	int quit;
+	/* the current job */
+	pool_fn *fn;
+	void *arg;
+	size_t nitems;
+	size_t grain;
+	unsigned nworkers;
+	struct worker worker[];
+};
+
+static int take(struct worker *w, size_t *chunk)
+{
+	int ok;
+
+	pthread_mutex_lock(&w->lock);
+	ok = w->lo < w->hi;
+	if (ok)
+		*chunk = w->lo++;
+	pthread_mutex_unlock(&w->lock);
+	return ok;
+}
+
+/* move the back half of the fullest other range to w */
+static int steal(struct worker *w)
+{
+	struct pool *p = w->pool;
+	struct worker *victim = NULL;
+	size_t best = 0, lo, hi;
+	unsigned i;
+
+	for (i = 0; i < p->nworkers; i++) {
+		struct worker *v = &p->worker[i];
+		size_t left;
+
+		if (v == w)
+			continue;
+		pthread_mutex_lock(&v->lock);
+		left = v->hi - v->lo;
+		pthread_mutex_unlock(&v->lock);
+		if (left > best) {
+			best = left;
+			victim = v;
+		}
+	}
+	if (!victim)
+		return 0;
+
+	pthread_mutex_lock(&victim->lock);
+	hi = victim->hi;
+	lo = victim->hi - (victim->hi - victim->lo + 1) / 2;
+	victim->hi = lo;
+	pthread_mutex_unlock(&victim->lock);
+	if (lo == hi)
+		return 1; /* lost a race, try again */
+
+	pthread_mutex_lock(&w->lock);
+	w->lo = lo;
+	w->hi = hi;
+	pthread_mutex_unlock(&w->lock);
+	return 1;
+}
+
+static void work(struct worker *w)
+{
+	struct pool *p = w->pool;
+	size_t chunk;
+
+	do {
+		while (take(w, &chunk)) {
+			size_t begin = chunk * p->grain;
+			size_t end = begin + p->grain;
+
+			if (end > p->nitems)
+				end = p->nitems;
+			p->fn(p->arg, w->id, begin, end);
+		}
+	} while (steal(w));
+}
+
+static void *worker_main(void *data)
+{
+	struct worker *w = data;
+	struct pool *p = w->pool;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (p->generation == seen)
+			pthread_cond_wait(&p->start, &p->lock);
+		seen = p->generation;
+		if (p->quit)
+			break;
+		pthread_mutex_unlock(&p->lock);
+
+		work(w);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->running == 0)
+			pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* nthreads of 0 uses one thread per online processor. */
+struct pool *pool_new(unsigned nthreads)
+{
+	struct pool *p;
+	unsigned i;
+
+	if (!nthreads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nthreads = n > 0 ? n : 1;
+	}
+	p = calloc(1, sizeof(*p) + nthreads * sizeof(*p->worker));
+	if (!p)
+		return NULL;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &p->worker[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->pool = p;
+		w->id = i;
+		if (pthread_create(&w->thread, NULL, worker_main, w)) {
+			pthread_mutex_destroy(&w->lock);
+			break;
+		}
+		p->nworkers++;
+	}
+	if (!p->nworkers) {
+		pool_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void pool_free(struct pool *p)
+{
+	unsigned i;
+
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->nworkers; i++) {
+		pthread_join(p->worker[i].thread, NULL);
+		pthread_mutex_destroy(&p->worker[i].lock);
+	}
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->start);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+unsigned pool_size(const struct pool *p)
+{
+	return p->nworkers;
+}
+
+/* calls fn over items 0 to nitems-1 in chunks of grain items, and returns
+ * once all of them are done. only one job may run on a pool at a time. */
+void pool_run(struct pool *p, size_t nitems, size_t grain, pool_fn *fn, void *arg)
+{
+	size_t nchunks, share;
+	unsigned i;
+
+	if (!nitems)
+		return;
+	if (!grain)
+		grain = 1;
+	nchunks = (nitems + grain - 1) / grain;
+	share = (nchunks + p->nworkers - 1) / p->nworkers;
+
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->nitems = nitems;
+	p->grain = grain;
+	for (i = 0; i < p->nworkers; i++) {
+		struct worker *w = &p->worker[i];
+
+		pthread_mutex_lock(&w->lock);
+		w->lo = i * share < nchunks ? i * share : nchunks;
+		w->hi = w->lo + share < nchunks ? w->lo + share : nchunks;
+		pthread_mutex_unlock(&w->lock);
+	}
+	p->running = p->nworkers;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	while (p->running)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+struct pool;
+
+/* called for items begin to end-1, worker is 0 to pool_size()-1 */
+typedef void pool_fn(void *arg, unsigned worker, size_t begin, size_t end);
+
+struct pool *pool_new(unsigned nthreads);
+void pool_free(struct pool *p);
+unsigned pool_size(const struct pool *p);
+void pool_run(struct pool *p, size_t nitems, size_t grain, pool_fn *fn, void *arg);
+#endif
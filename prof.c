@@ -0,0 +1,149 @@
+/* prof.c : report of where a profiled program spent its time. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+#include "prof.h"
+
+/* executions attributed to one instruction or one source position */
+struct hot {
+	unsigned pc;
+	unsigned line, ofs;
+	unsigned long count;
+};
+
+static int by_count(const void *a, const void *b)
+{
+	const struct hot *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	if (x->line != y->line)
+		return x->line < y->line ? -1 : 1;
+	if (x->ofs != y->ofs)
+		return x->ofs < y->ofs ? -1 : 1;
+	return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static int by_position(const void *a, const void *b)
+{
+	const struct hot *x = a, *y = b;
+
+	if (x->line != y->line)
+		return x->line < y->line ? -1 : 1;
+	return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
+}
+
+static double percent(unsigned long n, unsigned long total)
+{
+	return total ? 100.0 * n / total : 0.0;
+}
+
+/* prints line of src with a caret under column ofs, counting from 1 */
+static void show_source(FILE *f, const char *src, size_t len, unsigned line, unsigned ofs)
+{
+	size_t start = 0, end;
+	unsigned i;
+
+	if (!src || !line)
+		return;
+	for (i = 1; i < line; i++) {
+		while (start < len && src[start] != '\n')
+			start++;
+		if (start == len)
+			return;
+		start++;
+	}
+	for (end = start; end < len && src[end] != '\n'; end++)
+		;
+	fprintf(f, "        | %.*s\n        | ", (int)(end - start), src + start);
+	for (i = 1; i < ofs && start + i - 1 < end; i++)
+		fputc(src[start + i - 1] == '\t' ? '\t' : ' ', f);
+	fprintf(f, "^\n");
+}
+
+/* prints the top hottest source positions and instructions of code. src is
+ * the text the program was compiled from, or NULL if it is not available.
+ * returns 0 if out of memory. */
+int profile_report(FILE *f, const struct vmcode *code, const struct vmprofile *prof,
+	const char *src, size_t len, unsigned top)
+{
+	struct hot *insn, *pos;
+	const struct vmline *l;
+	struct vminsn in;
+	unsigned n = 0, npos = 0, i;
+	unsigned long total = 0;
+
+	insn = malloc(sizeof(*insn) * (code->len + 1));
+	pos = malloc(sizeof(*pos) * (code->len + 1));
+	if (!insn || !pos) {
+		free(insn);
+		free(pos);
+		return 0;
+	}
+	for (i = 0; i < code->len && vm_decode(code->buf, code->len, i, &in); i += in.len) {
+		l = vm_code_line(code, i);
+		insn[n].pc = i;
+		insn[n].line = l ? l->line : 0;
+		insn[n].ofs = l ? l->ofs : 0;
+		insn[n].count = prof->count[i];
+		total += insn[n].count;
+		n++;
+	}
+
+	/* several instructions, not always adjacent, share a position */
+	for (i = 0; i < n; i++)
+		pos[i] = insn[i];
+	qsort(pos, n, sizeof(*pos), by_position);
+	for (i = 0; i < n; i++) {
+		if (npos && !by_position(&pos[npos - 1], &pos[i]))
+			pos[npos - 1].count += pos[i].count;
+		else
+			pos[npos++] = pos[i];
+	}
+	qsort(pos, npos, sizeof(*pos), by_count);
+	qsort(insn, n, sizeof(*insn), by_count);
+
+	fprintf(f, "profile: %lu instructions executed\n", total);
+	fprintf(f, "hot source positions:\n");
+	for (i = 0; i < npos && i < top && pos[i].count; i++) {
+		fprintf(f, "%12lu %5.1f%%  %u:%u\n", pos[i].count,
+			percent(pos[i].count, total), pos[i].line, pos[i].ofs);
+		show_source(f, src, len, pos[i].line, pos[i].ofs);
+	}
+	fprintf(f, "hot instructions:\n");
+	fprintf(f, "%12s %6s  %6s %-6s %10s %12s  %s\n",
+		"count", "", "pc", "op", "arg", "taken", "line:col");
+	for (i = 0; i < n && i < top && insn[i].count; i++) {
+		vm_decode(code->buf, code->len, insn[i].pc, &in);
+		fprintf(f, "%12lu %5.1f%%  %6u %-6s %10u", insn[i].count,
+			percent(insn[i].count, total), insn[i].pc, vm_op_name(in.op), in.arg);
+		if (in.op == JZ || in.op == JNZ || in.op == JMP)
+			fprintf(f, " %12lu", prof->taken[insn[i].pc]);
+		else
+			fprintf(f, " %12s", "");
+		if (insn[i].line)
+			fprintf(f, "  %u:%u\n", insn[i].line, insn[i].ofs);
+		else
+			fprintf(f, "  -\n");
+	}
+	free(pos);
+	free(insn);
+	return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef PROF_H
+#define PROF_H
+#include <stdio.h>
+#include "vm.h"
+
+int profile_report(FILE *f, const struct vmcode *code, const struct vmprofile *prof,
+	const char *src, size_t len, unsigned top);
+#endif
@@ -0,0 +1,263 @@
+/* progen.c : generates large random programs for benchmarking. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* the generator has its own random numbers so a seed produces the same
+ * program everywhere, benchmark results can then be compared across
+ * commits and machines. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned long long rng_state;
+
+/* xorshift64* */
+static unsigned rnd(unsigned n)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (unsigned)((rng_state * 2685821657736338717ull) >> 32) % n;
+}
+
+static const char ops[] = "+-*/";
+
+static void leaf(unsigned nids)
+{
+	if (rnd(2))
+		printf("v%u", rnd(nids));
+	else
+		printf("%u", rnd(100) + 1);
+}
+
+static void op(const char *set)
+{
+	printf(" %c ", set[rnd(strlen(set))]);
+}
+
+/* random tree of about size leaves, using every construct */
+static void mixed(unsigned size, unsigned nids)
+{
+	unsigned left;
+
+	if (size <= 1) {
+		leaf(nids);
+		return;
+	}
+	if (size >= 4 && !rnd(4)) {
+		printf("(if (");
+		mixed(size / 4, nids);
+		printf(") then ");
+		mixed(size / 4 + size % 4, nids);
+		printf(" else ");
+		mixed(size / 2, nids);
+		printf(")");
+		return;
+	}
+	left = 1 + rnd(size - 1);
+	printf("(");
+	mixed(left, nids);
+	op(ops);
+	mixed(size - left, nids);
+	printf(")");
+}
+
+/* ((((x op y) op y) op y) ...) nested size levels */
+static void deep(unsigned size, unsigned nids)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++)
+		putchar('(');
+	leaf(nids);
+	for (i = 0; i < size; i++) {
+		op(ops);
+		leaf(nids);
+		putchar(')');
+	}
+}
+
+/* one long flat expression */
+static void wide(unsigned size, unsigned nids)
+{
+	unsigned i;
+
+	leaf(nids);
+	for (i = 1; i < size; i++) {
+		op("++-*");
+		leaf(nids);
+		if (i % 16 == 0)
+			putchar('\n');
+	}
+}
+
+/* a sum of small conditionals, half of them nested one level */
+static void cond(unsigned size, unsigned nids)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++) {
+		if (i)
+			printf(" +\n");
+		printf("(if (");
+		leaf(nids);
+		op("+-");
+		leaf(nids);
+		printf(") then ");
+		if (rnd(2)) {
+			printf("(if (");
+			leaf(nids);
+			printf(") then ");
+			leaf(nids);
+			printf(" else ");
+			leaf(nids);
+			printf(")");
+		} else {
+			leaf(nids);
+		}
+		printf(" else ");
+		leaf(nids);
+		op(ops);
+		leaf(nids);
+		printf(")");
+	}
+}
+
+/* a sum of conditionals built from a few subexpressions, each repeated in
+ * the condition and the arms like rules written by hand often are */
+static void shared(unsigned size, unsigned nids)
+{
+	char sub[8][64];
+	unsigned i;
+
+	for (i = 0; i < 8; i++) {
+		snprintf(sub[i], sizeof(sub[i]), "(v%u + v%u * %u)",
+			rnd(nids), rnd(nids), rnd(100) + 1);
+	}
+	for (i = 0; i < size; i++) {
+		unsigned a = rnd(8), b = rnd(8), c = rnd(8);
+
+		if (i)
+			printf(" +\n");
+		printf("(if (%s - %s) then %s * %s else %s / (%s + 1) + %s)",
+			sub[a], sub[b], sub[a], sub[c], sub[b], sub[c], sub[a]);
+	}
+}
+
+/* an identifier or a constant, sometimes written as a product */
+static void arm(unsigned nids)
+{
+	if (rnd(3))
+		leaf(nids);
+	else
+		printf("%u * %u", rnd(20) + 1, rnd(20) + 1);
+}
+
+/* a sum of conditionals with cheap arms, each taken at random. the
+ * condition keeps the lowest bit of the sum of two globals, so with random
+ * globals the sites disagree and a branch predictor can only guess. */
+static void coin(unsigned size, unsigned nids)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++) {
+		if (i)
+			printf(" +\n");
+		printf("(if ((v%u + v%u) * 2147483648) then ", rnd(nids), rnd(nids));
+		arm(nids);
+		printf(" else ");
+		arm(nids);
+		printf(")");
+	}
+}
+
+/* every term is a different identifier */
+static void ids(unsigned size, unsigned nids)
+{
+	unsigned i;
+
+	(void)nids;
+	for (i = 0; i < size; i++) {
+		if (i)
+			printf(i % 8 ? " + " : " +\n");
+		printf("id_%u", i);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(unsigned size, unsigned nids);
+	unsigned size; /* default */
+} kinds[] = {
+	{ "mixed", mixed, 20000 },
+	{ "deep", deep, 2000 },
+	{ "wide", wide, 50000 },
+	{ "cond", cond, 5000 },
+	{ "ids", ids, 10000 },
+	{ "shared", shared, 5000 },
+	{ "random", coin, 5000 },
+};
+
+static void usage(const char *prog)
+{
+	unsigned i;
+
+	fprintf(stderr, "usage: %s [-s seed] [-n size] [-i identifiers] kind\n"
+		"kinds:", prog);
+	for (i = 0; i < sizeof(kinds) / sizeof(*kinds); i++)
+		fprintf(stderr, " %s", kinds[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long seed = 1;
+	unsigned size = 0, nids = 26, i;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:i:")) != -1) {
+		switch (c) {
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			nids = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc || !nids) {
+		usage(argv[0]);
+		return 1;
+	}
+	rng_state = seed ? seed : 1;
+	for (i = 0; i < sizeof(kinds) / sizeof(*kinds); i++) {
+		if (!strcmp(argv[optind], kinds[i].name)) {
+			kinds[i].fn(size ? size : kinds[i].size, nids);
+			putchar('\n');
+			return 0;
+		}
+	}
+	usage(argv[0]);
+	return 1;
+}
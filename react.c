@@ -0,0 +1,309 @@
+/* react.c : re-evaluates only what a change to a global affects. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The tree is flattened into a table with every child ahead of its parents,
+ * each entry caching its value and listing its parents. A global lists the
+ * entries that read it, so the subtrees that depend on it are the ones
+ * reachable from there through the parents. Setting a global queues those
+ * entries, and bringing the value up to date recomputes queued entries in
+ * table order, queueing the parents of each one whose value changed. An if
+ * whose untaken arm changed keeps its value, so that is where it stops.
+ * The work done is proportional to the entries whose inputs changed, not
+ * to the size of the program.
+ */
+
+#include <string.h>
+
+#include "ast.h"
+#include "vm.h"
+#include "gen.h"
+#include "mem.h"
+#include "react.h"
+
+struct rnode {
+	enum ast_type type;
+	enum vmop op; /* N_2OP, the instruction it compiles to */
+	unsigned arg[3]; /* entries of the children, or the global slot */
+	vmcell value;
+	unsigned parent; /* first of its parents in react.parent */
+	unsigned nparents;
+	int queued;
+};
+
+struct react {
+	struct rnode *node; /* children ahead of parents, the root is last */
+	unsigned n;
+	unsigned max;
+	unsigned *parent;
+	vmcell *global;
+	unsigned nglobals;
+	unsigned *reader; /* entries reading global i are reader[first[i]..first[i+1]] */
+	unsigned *first;
+	unsigned *queue; /* heap of entries to recompute, lowest first */
+	unsigned nqueue;
+};
+
+static vmcell eval(const struct react *r, const struct rnode *e)
+{
+	const struct rnode *t = r->node;
+
+	switch (e->type) {
+	case N_2OP:
+		return vm_arith(e->op, t[e->arg[0]].value, t[e->arg[1]].value);
+	case N_COND:
+		return t[e->arg[0]].value ? t[e->arg[1]].value : t[e->arg[2]].value;
+	case N_VAR:
+		return r->global[e->arg[0]];
+	case N_NUM:
+		break;
+	}
+	return e->value;
+}
+
+/* appends the entry for n, whose children already have theirs in entry.
+ * returns 0 if out of memory. */
+static int add(struct react *r, struct ast_map *entry, ast_node n)
+{
+	struct rnode *e;
+	ast_node *child;
+	unsigned i;
+
+	if (r->n == r->max) {
+		unsigned max = r->max ? r->max * 2 : 64;
+
+		e = mem_realloc(r->node, sizeof(*e) * max);
+		if (!e)
+			return 0;
+		r->node = e;
+		r->max = max;
+	}
+	e = &r->node[r->n];
+	memset(e, 0, sizeof(*e));
+	e->type = n->type;
+	switch (n->type) {
+	case N_2OP:
+		e->op = gen_op(n->op);
+		break;
+	case N_NUM:
+		e->value = n->num;
+		break;
+	case N_VAR:
+		e->arg[0] = n->sym;
+		break;
+	case N_COND:
+		break;
+	}
+	for (i = 0; (child = ast_child(n, i)); i++)
+		e->arg[i] = ast_map_get(entry, *child);
+	return ast_map_set(entry, n, r->n++);
+}
+
+/* flattens the tree rooted at root, visiting each shared node once. a node
+ * is in entry from when it is first seen, with ~0u - 1 until it is added. */
+static int flatten(struct react *r, ast_node root)
+{
+	struct ast_map entry;
+	struct ast_stack s;
+	struct ast_frame *f;
+	ast_node *child;
+	int ok = 1;
+
+	ast_map_init(&entry);
+	ast_stack_init(&s);
+	if (!ast_map_set(&entry, root, ~0u - 1) || !ast_push(&s, root, 0))
+		ok = 0;
+	while (ok && s.n) {
+		f = &s.frame[s.n - 1];
+		child = ast_child(f->node, f->step++);
+		if (!child) {
+			ok = add(r, &entry, f->node);
+			s.n--;
+		} else if (ast_map_get(&entry, *child) == ~0u) {
+			if (!ast_map_set(&entry, *child, ~0u - 1) || !ast_push(&s, *child, 0))
+				ok = 0;
+		}
+	}
+	ast_stack_free(&s);
+	ast_map_free(&entry);
+	return ok;
+}
+
+/* a child appearing twice under one parent lists it once */
+static int first_use(const struct rnode *e, unsigned i)
+{
+	unsigned j;
+
+	for (j = 0; j < i; j++) {
+		if (e->arg[j] == e->arg[i])
+			return 0;
+	}
+	return 1;
+}
+
+static unsigned nchildren(const struct rnode *e)
+{
+	return e->type == N_2OP ? 2 : e->type == N_COND ? 3 : 0;
+}
+
+/* fills in the parents of every entry and the readers of every global */
+static int link_nodes(struct react *r)
+{
+	struct rnode *e;
+	unsigned i, j, k, total = 0;
+
+	for (e = r->node; e < r->node + r->n; e++) {
+		for (j = 0; j < nchildren(e); j++) {
+			if (first_use(e, j)) {
+				r->node[e->arg[j]].nparents++;
+				total++;
+			}
+		}
+		if (e->type == N_VAR && e->arg[0] < r->nglobals)
+			r->first[e->arg[0] + 1]++;
+	}
+	r->parent = mem_alloc(sizeof(*r->parent) * (total ? total : 1));
+	r->reader = mem_alloc(sizeof(*r->reader) * (r->n ? r->n : 1));
+	if (!r->parent || !r->reader)
+		return 0;
+	for (i = 0, k = 0; i < r->n; i++) {
+		r->node[i].parent = k;
+		k += r->node[i].nparents;
+		r->node[i].nparents = 0;
+	}
+	for (i = 0; i < r->nglobals; i++)
+		r->first[i + 1] += r->first[i];
+	for (i = 0; i < r->n; i++) {
+		e = &r->node[i];
+		for (j = 0; j < nchildren(e); j++) {
+			struct rnode *c = &r->node[e->arg[j]];
+
+			if (first_use(e, j))
+				r->parent[c->parent + c->nparents++] = i;
+		}
+		if (e->type == N_VAR && e->arg[0] < r->nglobals)
+			r->reader[r->first[e->arg[0]]++] = i;
+	}
+	/* the fill moved each start to the next global's, shift them back */
+	for (i = r->nglobals; i > 0; i--)
+		r->first[i] = r->first[i - 1];
+	r->first[0] = 0;
+	return 1;
+}
+
+/* root is an optimized tree, which need not outlive the result. the globals
+ * start at 0 and the value is computed once for them. returns NULL if out of
+ * memory. */
+struct react *react_new(ast_node root, unsigned nglobals)
+{
+	struct react *r;
+	unsigned i;
+
+	r = mem_calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->nglobals = nglobals;
+	r->global = mem_calloc(nglobals ? nglobals : 1, sizeof(*r->global));
+	r->first = mem_calloc(nglobals + 1, sizeof(*r->first));
+	if (!r->global || !r->first || !flatten(r, root) || !link_nodes(r))
+		goto fail;
+	r->queue = mem_alloc(sizeof(*r->queue) * r->n);
+	if (!r->queue)
+		goto fail;
+	for (i = 0; i < r->n; i++)
+		r->node[i].value = eval(r, &r->node[i]);
+	return r;
+fail:
+	react_free(r);
+	return NULL;
+}
+
+void react_free(struct react *r)
+{
+	if (!r)
+		return;
+	mem_free(r->queue);
+	mem_free(r->reader);
+	mem_free(r->first);
+	mem_free(r->global);
+	mem_free(r->parent);
+	mem_free(r->node);
+	mem_free(r);
+}
+
+static void enqueue(struct react *r, unsigned i)
+{
+	unsigned *q = r->queue, k;
+
+	if (r->node[i].queued)
+		return;
+	r->node[i].queued = 1;
+	k = r->nqueue++;
+	while (k > 0 && q[(k - 1) / 2] > i) {
+		q[k] = q[(k - 1) / 2];
+		k = (k - 1) / 2;
+	}
+	q[k] = i;
+}
+
+static unsigned dequeue(struct react *r)
+{
+	unsigned *q = r->queue, top = q[0], last = q[--r->nqueue], k = 0, c;
+
+	while ((c = 2 * k + 1) < r->nqueue) {
+		if (c + 1 < r->nqueue && q[c + 1] < q[c])
+			c++;
+		if (q[c] >= last)
+			break;
+		q[k] = q[c];
+		k = c;
+	}
+	q[k] = last;
+	r->node[top].queued = 0;
+	return top;
+}
+
+/* the new value is not computed until react_value() asks for it, setting a
+ * global to the value it already has costs nothing. */
+void react_set(struct react *r, unsigned i, vmcell v)
+{
+	unsigned j;
+
+	if (i >= r->nglobals || r->global[i] == v)
+		return;
+	r->global[i] = v;
+	for (j = r->first[i]; j < r->first[i + 1]; j++)
+		enqueue(r, r->reader[j]);
+}
+
+/* the value of the tree for the globals as they are now */
+vmcell react_value(struct react *r)
+{
+	struct rnode *e;
+	vmcell v;
+	unsigned j;
+
+	while (r->nqueue) {
+		e = &r->node[dequeue(r)];
+		v = eval(r, e);
+		if (v == e->value)
+			continue;
+		e->value = v;
+		for (j = 0; j < e->nparents; j++)
+			enqueue(r, r->parent[e->parent + j]);
+	}
+	return r->node[r->n - 1].value;
+}
@@ -0,0 +1,11 @@
+#ifndef REACT_H
+#define REACT_H
+#include "ast.h"
+#include "vm.h"
+struct react;
+
+struct react *react_new(ast_node root, unsigned nglobals);
+void react_free(struct react *r);
+void react_set(struct react *r, unsigned i, vmcell v);
+vmcell react_value(struct react *r);
+#endif
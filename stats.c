@@ -0,0 +1,98 @@
+/* stats.c : counters and timers that can be switched on at run time. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* the counters are process wide and updated with relaxed atomics, so threads
+ * can share them. instructions are only counted by vm_run(), code run by the
+ * JIT or by the vector lanes of batch.c is not seen. */
+
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "stats.h"
+
+int stats_enabled;
+struct stats stats_counters;
+
+static const char *const phase_name[STATS_PHASES] = {
+	[PHASE_PARSE] = "parse",
+	[PHASE_OPTIMIZE] = "optimize",
+	[PHASE_COMPILE] = "compile",
+	[PHASE_RUN] = "run",
+};
+
+void stats_enable(int on)
+{
+	stats_enabled = on;
+}
+
+void stats_reset(void)
+{
+	memset(&stats_counters, 0, sizeof(stats_counters));
+}
+
+/* not a consistent snapshot if other threads are still counting */
+void stats_get(struct stats *out)
+{
+	*out = stats_counters;
+}
+
+/* monotonic nanoseconds, or 0 while stats are off */
+unsigned long long stats_clock(void)
+{
+	struct timespec ts;
+
+	if (!stats_enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* charge the time since start, a value from stats_clock(), to phase */
+void stats_phase(enum stats_phase phase, unsigned long long start)
+{
+	if (!stats_enabled || !start)
+		return;
+	STATS_ADD(calls[phase], 1);
+	STATS_ADD(nsec[phase], stats_clock() - start);
+}
+
+void stats_dump_json(FILE *f)
+{
+	struct stats s;
+	unsigned i;
+	int first = 1;
+
+	stats_get(&s);
+	fprintf(f, "{\"tokens\":%lu,\"nodes\":%lu,\"shared\":%lu,\"code_bytes\":%lu,\"insns\":%lu,",
+		s.tokens, s.nodes, s.shared, s.code_bytes, s.insns);
+	fprintf(f, "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"evictions\":%lu},",
+		s.cache_hits, s.cache_misses, s.cache_evictions);
+	fprintf(f, "\"ops\":{");
+	for (i = 0; i < VM_OP_COUNT; i++) {
+		if (!s.ops[i])
+			continue;
+		fprintf(f, "%s\"%s\":%lu", first ? "" : ",", vm_op_name(i), s.ops[i]);
+		first = 0;
+	}
+	fprintf(f, "},\"phases\":{");
+	for (i = 0; i < STATS_PHASES; i++) {
+		fprintf(f, "%s\"%s\":{\"calls\":%lu,\"seconds\":%.9f}", i ? "," : "",
+			phase_name[i], s.calls[i], s.nsec[i] / 1e9);
+	}
+	fprintf(f, "}}\n");
+}
@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include "vm.h"
+
+enum stats_phase {
+	PHASE_PARSE, /* lexing included */
+	PHASE_OPTIMIZE,
+	PHASE_COMPILE,
+	PHASE_RUN,
+	STATS_PHASES
+};
+
+struct stats {
+	unsigned long tokens; /* lexed */
+	unsigned long nodes; /* ast nodes allocated */
+	unsigned long shared; /* nodes replaced by an identical one */
+	unsigned long code_bytes; /* emitted by compile() */
+	unsigned long insns; /* executed by vm_run() */
+	unsigned long cache_hits; /* sources found compiled in a cache */
+	unsigned long cache_misses;
+	unsigned long cache_evictions;
+	unsigned long ops[VM_OP_COUNT]; /* executed, by opcode */
+	unsigned long calls[STATS_PHASES];
+	unsigned long long nsec[STATS_PHASES]; /* wall time */
+};
+
+extern int stats_enabled;
+
+/* counters cost one test of stats_enabled while they are off */
+#if defined(__GNUC__)
+# define STATS_ADD(field, n) do { if (stats_enabled) \
+	__atomic_fetch_add(&stats_counters.field, (n), __ATOMIC_RELAXED); } while (0)
+#else
+# define STATS_ADD(field, n) do { if (stats_enabled) \
+	stats_counters.field += (n); } while (0)
+#endif
+
+extern struct stats stats_counters;
+
+void stats_enable(int on);
+void stats_reset(void);
+void stats_get(struct stats *out);
+unsigned long long stats_clock(void);
+void stats_phase(enum stats_phase phase, unsigned long long start);
+void stats_dump_json(FILE *f);
+#endif
@@ -0,0 +1,185 @@
+/* sym.c : interned identifiers and keywords. */
+/*
+ * Copyright (c) 2013 Jon Mayo <jon@rm-f.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "sym.h"
+#include "tok.h"
+#include "mem.h"
+
+#define SYMTAB_INITIAL 64 /* must be a power of two */
+
+/* open addressing with linear probing, keywords are entered up front so the
+ * lexer classifies a word with the same lookup that interns it. */
+struct symtab {
+	struct symbol *slot;
+	unsigned mask;
+	unsigned used;
+	unsigned count; /* identifiers only */
+	struct arena *arena;
+};
+
+static const struct {
+	const char *name;
+	enum token tok;
+} keywords[] = {
+	{ "if", T_IF },
+	{ "then", T_THEN },
+	{ "else", T_ELSE },
+};
+
+/* FNV-1a */
+static unsigned sym_hash(const char *s, size_t len)
+{
+	unsigned h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct symbol *sym_find(struct symtab *t, const char *s, size_t len, unsigned hash)
+{
+	unsigned i;
+
+	for (i = hash & t->mask; t->slot[i].name; i = (i + 1) & t->mask) {
+		struct symbol *sym = &t->slot[i];
+
+		if (sym->hash == hash && sym->len == len && !memcmp(sym->name, s, len))
+			break;
+	}
+	return &t->slot[i];
+}
+
+static int symtab_grow(struct symtab *t)
+{
+	struct symbol *old = t->slot;
+	unsigned i, old_size = t->mask + 1;
+
+	t->slot = mem_calloc(old_size * 2, sizeof(*t->slot));
+	if (!t->slot) {
+		t->slot = old;
+		return 0;
+	}
+	t->mask = old_size * 2 - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].name)
+			*sym_find(t, old[i].name, old[i].len, old[i].hash) = old[i];
+	}
+	mem_free(old);
+	return 1;
+}
+
+static void add_keywords(struct symtab *t)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
+		size_t len = strlen(keywords[i].name);
+		unsigned hash = sym_hash(keywords[i].name, len);
+		struct symbol *sym = sym_find(t, keywords[i].name, len, hash);
+
+		sym->name = keywords[i].name;
+		sym->len = len;
+		sym->hash = hash;
+		sym->tok = keywords[i].tok;
+		t->used++;
+	}
+}
+
+struct symtab *symtab_new(struct arena *arena)
+{
+	struct symtab *t;
+
+	t = mem_calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->slot = mem_calloc(SYMTAB_INITIAL, sizeof(*t->slot));
+	if (!t->slot) {
+		mem_free(t);
+		return NULL;
+	}
+	t->mask = SYMTAB_INITIAL - 1;
+	t->arena = arena;
+	add_keywords(t);
+	return t;
+}
+
+/* forget every identifier, for when the arena holding their names is reset.
+ * the table keeps its size. */
+void symtab_reset(struct symtab *t)
+{
+	memset(t->slot, 0, sizeof(*t->slot) * (t->mask + 1));
+	t->used = 0;
+	t->count = 0;
+	add_keywords(t);
+}
+
+void symtab_free(struct symtab *t)
+{
+	if (!t)
+		return;
+	mem_free(t->slot);
+	mem_free(t);
+}
+
+/* returns the existing entry for s, or adds a new identifier.
+ * the pointer is only valid until the next call. */
+const struct symbol *sym_intern(struct symtab *t, const char *s, size_t len)
+{
+	unsigned hash = sym_hash(s, len);
+	struct symbol *sym = sym_find(t, s, len, hash);
+
+	if (sym->name)
+		return sym;
+	/* keep the load factor under 1/2 */
+	if ((t->used + 1) * 2 > t->mask + 1) {
+		if (!symtab_grow(t))
+			return NULL;
+		sym = sym_find(t, s, len, hash);
+	}
+	sym->name = arena_strndup(t->arena, s, len);
+	if (!sym->name)
+		return NULL;
+	sym->len = len;
+	sym->hash = hash;
+	sym->tok = T_IDENTIFIER;
+	sym->index = t->count++;
+	t->used++;
+	return sym;
+}
+
+unsigned symtab_count(const struct symtab *t)
+{
+	return t->count;
+}
+
+/* stores every identifier in sym[], at its index. sym[] must have room for
+ * symtab_count() entries. */
+void symtab_list(const struct symtab *t, const struct symbol **sym)
+{
+	unsigned i;
+
+	for (i = 0; i <= t->mask; i++) {
+		if (t->slot[i].name && t->slot[i].tok == T_IDENTIFIER)
+			sym[t->slot[i].index] = &t->slot[i];
+	}
+}
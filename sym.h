@@ -0,0 +1,21 @@
+#ifndef SYM_H
+#define SYM_H
+#include <stddef.h>
+struct arena;
+struct symtab;
+
+struct symbol {
+	const char *name; /* NUL terminated, owned by the arena */
+	unsigned len;
+	unsigned hash;
+	int tok; /* T_IDENTIFIER or the keyword's token */
+	unsigned index; /* dense identifier number, in order of first use */
+};
+
+struct symtab *symtab_new(struct arena *arena);
+void symtab_free(struct symtab *t);
+void symtab_reset(struct symtab *t);
+const struct symbol *sym_intern(struct symtab *t, const char *s, size_t len);
+unsigned symtab_count(const struct symtab *t);
+void symtab_list(const struct symtab *t, const struct symbol **sym);
+#endif
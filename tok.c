@@ -19,37 +19,87 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "arena.h"
+#include "sym.h"
 #include "tok.h"
+#include "stats.h"
+#include "mem.h"
 #include "trace.h"
 
 /* parser state */
 struct pstate {
 	int ch;
 	int error;
+	const char *error_reason; /* the first error */
+	int error_line;
+	int error_ofs;
 	enum token tok;
+	int tok_line; /* where tok starts */
+	int tok_ofs;
 	int line;
-	int offset;
 	long num_buf;
-	char id_buf[64];
+	const char *id_name; /* interned, owned by arena */
+	unsigned id_sym;
+	struct symtab *syms;
+	struct arena *arena; /* owns the nodes built from this input */
+	int share; /* merge repeated subexpressions into one node */
+	/* input buffer, ch is the character just before p */
+	const char *p;
+	const char *end;
+	const char *line_start;
+	/* backing storage when the input is owned by the pstate */
+	void *map;
+	size_t map_len;
+	char *buf;
 };
 
+/* only the first error is kept, the input is treated as ended after it. */
 void error(struct pstate *st, const char *reason)
 {
+	if (!st->error) {
+		st->error_reason = reason;
+		st->error_line = st->line;
+		st->error_ofs = ofs_cur(st);
+	}
 	st->error = 1;
 	st->tok = T_EOF;
-	fprintf(stderr, "ERROR:line=%d,ofs=%d:%s\n", st->line, st->offset, reason);
 }
 
 void ch_next(struct pstate *st)
 {
 	if (st->ch == EOF)
 		return;
-	st->ch = getchar();
-	st->offset++;
+	if (st->p == st->end) {
+		st->ch = EOF;
+		return;
+	}
+	st->ch = (unsigned char)*st->p++;
 	if (st->ch == '\n') {
 		st->line++;
-		st->offset = 0;
+		st->line_start = st->p;
+	}
+}
+
+/* make the character at p current. like ch_next(), a newline is counted
+ * as soon as it becomes current. */
+static void ch_seek(struct pstate *st, const char *p)
+{
+	if (p < st->end) {
+		st->ch = (unsigned char)*p;
+		st->p = p + 1;
+		if (st->ch == '\n') {
+			st->line++;
+			st->line_start = st->p;
+		}
+	} else {
+		st->ch = EOF;
+		st->p = st->end;
 	}
 }
 
@@ -59,19 +109,91 @@ int last_error(struct pstate *st)
 	return st->error;
 }
 
+/* returns the reason for the first error and where it happened, or NULL. */
+const char *error_msg(struct pstate *st, int *line, int *ofs)
+{
+	if (!st->error)
+		return NULL;
+	*line = st->error_line;
+	*ofs = st->error_ofs;
+	return st->error_reason;
+}
+
+/* writes the first error to stderr, if there was one. */
+void error_print(struct pstate *st)
+{
+	const char *reason;
+	int line, ofs;
+
+	reason = error_msg(st, &line, &ofs);
+	if (reason)
+		fprintf(stderr, "ERROR:line=%d,ofs=%d:%s\n", line, ofs, reason);
+}
+
 int line_cur(struct pstate *st)
 {
 	return st->line;
 }
 
+/* column of the current character, the newline itself is column 0 */
+int ofs_cur(struct pstate *st)
+{
+	return st->p - st->line_start;
+}
+
+/* position of the current token */
+int tok_line(struct pstate *st)
+{
+	return st->tok_line;
+}
+
+int tok_ofs(struct pstate *st)
+{
+	return st->tok_ofs;
+}
+
 long num_buf(struct pstate *st)
 {
 	return st->num_buf;
 }
 
-const char *id_buf(struct pstate *st)
+const char *id_name(struct pstate *st)
+{
+	return st->id_name;
+}
+
+unsigned id_sym(struct pstate *st)
+{
+	return st->id_sym;
+}
+
+/* number of distinct identifiers seen so far */
+unsigned sym_count(struct pstate *st)
+{
+	return symtab_count(st->syms);
+}
+
+/* the identifiers by index, see symtab_list() */
+void sym_list(struct pstate *st, const struct symbol **sym)
+{
+	symtab_list(st->syms, sym);
+}
+
+struct arena *pstate_arena(struct pstate *st)
+{
+	return st->arena;
+}
+
+/* with sharing off every subexpression keeps a node, and a position, of its
+ * own. it is on for a new pstate. */
+void pstate_share(struct pstate *st, int on)
+{
+	st->share = on;
+}
+
+int pstate_shares(struct pstate *st)
 {
-	return st->id_buf;
+	return st->share;
 }
 
 int ch_cur(struct pstate *st)
@@ -100,23 +222,31 @@ int require(struct pstate *st, char *str)
 
 void discard_whitespace(struct pstate *st)
 {
+	const char *p, *end = st->end;
+
 	TRACE;
-	while (isspace(ch_cur(st)))
-		ch_next(st);
+	if (!isspace(ch_cur(st)))
+		return;
+	for (p = st->p; p < end && isspace((unsigned char)*p); p++) {
+		if (*p == '\n') {
+			st->line++;
+			st->line_start = p + 1;
+		}
+	}
+	ch_seek(st, p);
 }
 
 /* number ::= [0-9]+ */
 void parse_number(struct pstate *st)
 {
-	int ch = ch_cur(st);
+	const char *p = st->p - 1, *end = st->end;
+	long n = 0;
 
 	st->tok = T_NUMBER;
-	st->num_buf = 0;
-	while (isdigit(ch)) {
-		st->num_buf = (st->num_buf * 10) + (ch - '0');
-		ch_next(st);
-		ch = ch_cur(st);
-	}
+	while (p < end && isdigit((unsigned char)*p))
+		n = (n * 10) + (*p++ - '0');
+	st->num_buf = n;
+	ch_seek(st, p);
 	TRACE_FMT("T_NUMBER=%ld\n", st->num_buf);
 }
 
@@ -125,38 +255,21 @@ void parse_number(struct pstate *st)
  */
 void parse_identifier(struct pstate *st)
 {
-	unsigned cnt;
-	int ch = ch_cur(st);
+	const char *start = st->p - 1, *p = start, *end = st->end;
+	const struct symbol *sym;
 
-	cnt = 0;
-	while (isalnum(ch) || ch == '_') {
-		if (cnt > sizeof(st->id_buf) - 1) {
-			error(st, "identifier too long");
-			st->id_buf[0] = 0;
-			return;
-		}
-		st->id_buf[cnt] = ch;
-		cnt++;
-		ch_next(st);
-		ch = ch_cur(st);
-	}
-	st->id_buf[cnt] = 0;
-	if (!strcmp(st->id_buf, "if")) {
-		TRACE_FMT("T_IF\n");
-		st->tok = T_IF;
-		st->id_buf[0] = 0;
-	} else if (!strcmp(st->id_buf, "then")) {
-		TRACE_FMT("T_THEN\n");
-		st->tok = T_THEN;
-		st->id_buf[0] = 0;
-	} else if (!strcmp(st->id_buf, "else")) {
-		TRACE_FMT("T_ELSE\n");
-		st->tok = T_ELSE;
-		st->id_buf[0] = 0;
-	} else {
-		TRACE_FMT("T_IDENTIFIER\n");
-		st->tok = T_IDENTIFIER;
+	while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+		p++;
+	sym = sym_intern(st->syms, start, p - start);
+	if (!sym) {
+		error(st, "out of memory");
+		return;
 	}
+	ch_seek(st, p);
+	st->tok = sym->tok;
+	st->id_name = sym->name;
+	st->id_sym = sym->index;
+	TRACE_FMT("%s():tok=%d,id=%s\n", __func__, st->tok, st->id_name);
 }
 
 void tok_next(struct pstate *st)
@@ -164,7 +277,10 @@ void tok_next(struct pstate *st)
 	char ch;
 
 	TRACE;
+	STATS_ADD(tokens, 1);
 	discard_whitespace(st); /* TODO: is this correct?? */
+	st->tok_line = st->line;
+	st->tok_ofs = ofs_cur(st);
 	ch = ch_cur(st);
 	if (ch == EOF) {
 		st->tok = T_EOF;
@@ -202,18 +318,133 @@ int tok_cur(struct pstate *st)
 	return st->error ? T_EOF : st->tok;
 }
 
-struct pstate *pstate_new(void)
+/* point st at new input, as if it had just been created for it. identifiers
+ * from the old input are forgotten, so the arena may be reset first. */
+void pstate_reset(struct pstate *st, const char *buf, size_t len)
+{
+	if (st->map)
+		munmap(st->map, st->map_len);
+	mem_free(st->buf);
+	st->map = NULL;
+	st->map_len = 0;
+	st->buf = NULL;
+	symtab_reset(st->syms);
+	st->error = 0;
+	st->p = st->line_start = buf;
+	st->end = buf + len;
+	st->ch = '\n';
+	st->line = 1;
+	tok_next(st);
+}
+
+/* lex directly from buf, which must be preserved until pstate_free() */
+struct pstate *pstate_new_buffer(struct arena *arena, const char *buf, size_t len)
 {
 	struct pstate *st;
 
-	st = calloc(1, sizeof(*st));
+	st = mem_calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	st->arena = arena;
+	st->share = 1;
+	st->syms = symtab_new(arena);
+	if (!st->syms) {
+		mem_free(st);
+		return NULL;
+	}
+	st->p = st->line_start = buf;
+	st->end = buf + len;
 	st->ch = '\n';
 	st->line = 1;
 	tok_next(st);
 	return st;
 }
 
+/* map regular files, slurp anything else (pipes, terminals) into memory. */
+static struct pstate *pstate_new_fd(struct arena *arena, int fd, const char *name)
+{
+	struct pstate *st;
+	struct stat sb;
+	void *map = NULL;
+	size_t map_len = 0;
+	char *buf = NULL;
+	size_t len = 0, max = 0;
+
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		map_len = sb.st_size;
+		map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+	}
+	if (!map) {
+		ssize_t cnt;
+
+		do {
+			if (len == max) {
+				char *tmp;
+
+				max = max ? max * 2 : 65536;
+				tmp = mem_realloc(buf, max);
+				if (!tmp) {
+					fprintf(stderr, "ERROR:%s:out of memory\n", name);
+					mem_free(buf);
+					return NULL;
+				}
+				buf = tmp;
+			}
+			cnt = read(fd, buf + len, max - len);
+			if (cnt < 0 && errno == EINTR)
+				continue; /* cnt is not 0, so the loop goes on */
+			if (cnt < 0) {
+				fprintf(stderr, "ERROR:%s:%s\n", name, strerror(errno));
+				mem_free(buf);
+				return NULL;
+			}
+			len += cnt;
+		} while (cnt != 0);
+	}
+
+	st = pstate_new_buffer(arena, map ? map : buf, map ? map_len : len);
+	if (!st) {
+		if (map)
+			munmap(map, map_len);
+		mem_free(buf);
+		return NULL;
+	}
+	st->map = map;
+	st->map_len = map_len;
+	st->buf = buf;
+	return st;
+}
+
+struct pstate *pstate_new_file(struct arena *arena, const char *filename)
+{
+	struct pstate *st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR:%s:%s\n", filename, strerror(errno));
+		return NULL;
+	}
+	st = pstate_new_fd(arena, fd, filename);
+	close(fd);
+	return st;
+}
+
+/* lex from standard input */
+struct pstate *pstate_new(struct arena *arena)
+{
+	return pstate_new_fd(arena, STDIN_FILENO, "stdin");
+}
+
 void pstate_free(struct pstate *st)
 {
-	free(st);
+	if (!st)
+		return;
+	if (st->map)
+		munmap(st->map, st->map_len);
+	mem_free(st->buf);
+	symtab_free(st->syms);
+	mem_free(st);
 }
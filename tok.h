@@ -1,6 +1,9 @@
 #ifndef TOK_H
 #define TOK_H
+#include <stddef.h>
 struct pstate;
+struct arena;
+struct symbol;
 
 enum token {
 	T_EOF,
@@ -15,14 +18,28 @@ void error(struct pstate *st, const char *reason);
 void ch_next(struct pstate *st);
 int ch_cur(struct pstate *st);
 int last_error(struct pstate *st);
+const char *error_msg(struct pstate *st, int *line, int *ofs);
+void error_print(struct pstate *st);
 int line_cur(struct pstate *st);
+int ofs_cur(struct pstate *st);
+int tok_line(struct pstate *st);
+int tok_ofs(struct pstate *st);
 long num_buf(struct pstate *st);
-const char *id_buf(struct pstate *st);
+const char *id_name(struct pstate *st);
+unsigned id_sym(struct pstate *st);
+unsigned sym_count(struct pstate *st);
+void sym_list(struct pstate *st, const struct symbol **sym);
 int eat(struct pstate *st, char c);
 int require(struct pstate *st, char *str);
 void discard_whitespace(struct pstate *st);
 void tok_next(struct pstate *st);
 int tok_cur(struct pstate *st);
-struct pstate *pstate_new(void);
+struct arena *pstate_arena(struct pstate *st);
+void pstate_share(struct pstate *st, int on);
+int pstate_shares(struct pstate *st);
+struct pstate *pstate_new(struct arena *arena);
+struct pstate *pstate_new_buffer(struct arena *arena, const char *buf, size_t len);
+struct pstate *pstate_new_file(struct arena *arena, const char *filename);
+void pstate_reset(struct pstate *st, const char *buf, size_t len);
 void pstate_free(struct pstate *st);
 #endif
@@ -17,39 +17,301 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "trace.h"
 #include "vm.h"
+#include "stats.h"
+#include "mem.h"
 
 
+#if defined(__GNUC__) && !defined(VM_NO_THREADED)
+# define VM_THREADED 1
+#endif
+
+/* threaded code, an entry for each opcode and one for each operand. opcodes
+ * are replaced by the address of their handler and jump operands by their
+ * destination. */
+union vmthread {
+	const void *handler;
+	vmcell arg;
+	union vmthread *target;
+};
+
 struct vmstate {
 	vmcell pc;
 	vmcell sp;
-	vmcell stack[128];
-	vmcell global[26];
-	const vmcell *code;
+	vmcell *stack; /* as deep as vm_verify() found the program needs */
+	unsigned stack_max;
+	vmcell *global;
+	unsigned nglobals;
+	unsigned global_max; /* allocated slots */
+	const unsigned char *code;
 	unsigned code_len;
+	int threaded; /* the code was translated into thread */
+	union vmthread *thread;
+	unsigned thread_max;
+	unsigned *index; /* scratch for the translation */
+	unsigned index_max;
+	struct vmprofile *prof; /* NULL unless profiling */
+	vmcell result; /* top of the stack at HALT */
+};
+
+static const char *const op_name[VM_OP_COUNT] = {
+	[HALT] = "HALT", [IFETCH] = "IFETCH", [ISTORE] = "ISTORE",
+	[IPUSH] = "IPUSH", [IPOP] = "IPOP",
+	[IADD] = "IADD", [ISUB] = "ISUB", [UMUL] = "UMUL", [UDIV] = "UDIV",
+	[ILT] = "ILT",
+	[JZ] = "JZ", [JNZ] = "JNZ", [JMP] = "JMP",
+	[IADDI] = "IADDI", [ISUBI] = "ISUBI", [UMULI] = "UMULI", [UDIVI] = "UDIVI",
+	[IADDG] = "IADDG", [ISUBG] = "ISUBG", [UMULG] = "UMULG", [UDIVG] = "UDIVG",
+	[IDUP] = "IDUP", [TALLOC] = "TALLOC", [TSTORE] = "TSTORE", [TFETCH] = "TFETCH",
+	[SELECT] = "SELECT",
 };
 
-static enum vmop vm_next(struct vmstate *vm)
+const char *vm_op_name(enum vmop op)
+{
+	return (unsigned)op < VM_OP_COUNT ? op_name[op] : "?";
+}
+
+/* returns 1 if op is followed by an operand, 0 if not, -1 if op is unknown */
+static int op_operand(unsigned op)
+{
+	switch (op) {
+	case HALT: case IPOP:
+	case IADD: case ISUB: case UMUL: case UDIV:
+	case ILT: case IDUP: case SELECT:
+		return 0;
+	case IFETCH: case ISTORE: case IPUSH:
+	case JZ: case JNZ: case JMP:
+	case IADDI: case ISUBI: case UMULI: case UDIVI:
+	case IADDG: case ISUBG: case UMULG: case UDIVG:
+	case TALLOC: case TSTORE: case TFETCH:
+		return 1;
+	}
+	return -1;
+}
+
+static int op_is_jump(enum vmop op)
+{
+	return op == JZ || op == JNZ || op == JMP;
+}
+
+/* the operand is a global slot */
+static int op_is_global(enum vmop op)
+{
+	switch (op) {
+	case IFETCH: case ISTORE:
+	case IADDG: case ISUBG: case UMULG: case UDIVG:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* cells an instruction needs on the stack */
+static int op_pops(enum vmop op)
+{
+	switch (op) {
+	case IFETCH: case IPUSH: case JMP:
+	case TALLOC: case TFETCH:
+		return 0;
+	case HALT: case ISTORE: case IPOP:
+	case JZ: case JNZ:
+	case IADDI: case ISUBI: case UMULI: case UDIVI:
+	case IADDG: case ISUBG: case UMULG: case UDIVG:
+	case IDUP: case TSTORE:
+		return 1;
+	case IADD: case ISUB: case UMUL: case UDIV:
+	case ILT:
+		return 2;
+	case SELECT:
+		return 3;
+	}
+	return 0;
+}
+
+/* cells an instruction leaves on the stack in place of the ones it needed.
+ * TALLOC leaves as many as its operand says, that is up to the caller. */
+static int op_pushes(enum vmop op)
+{
+	switch (op) {
+	case ISTORE: case IPOP:
+	case JZ: case JNZ: case JMP:
+	case TALLOC:
+		return 0;
+	case HALT: case IFETCH: case IPUSH:
+	case IADD: case ISUB: case UMUL: case UDIV:
+	case ILT:
+	case IADDI: case ISUBI: case UMULI: case UDIVI:
+	case IADDG: case ISUBG: case UMULG: case UDIVG:
+	case TSTORE: case TFETCH:
+	case SELECT:
+		return 1;
+	case IDUP:
+		return 2;
+	}
+	return 0;
+}
+
+/* Encoding: one opcode byte, then the operand if it has one as a
+ * little-endian base 128 varint, 7 bits per byte with the high bit set on
+ * every byte but the last. Jump operands are signed offsets from the end of
+ * the instruction, zigzag encoded so short backward jumps stay short. An
+ * operand may be padded with extra 0x80 bytes, the layout of jumps relies on
+ * that.
+ */
+
+#define VARINT_MAX 5 /* bytes needed for 32 bits */
+
+static vmcell zigzag(vmcell v)
+{
+	return (v << 1) ^ (vmcell)-(v >> (sizeof(v) * 8 - 1));
+}
+
+static vmcell unzigzag(vmcell v)
+{
+	return (v >> 1) ^ (vmcell)-(v & 1);
+}
+
+static unsigned varint_len(vmcell v)
+{
+	unsigned n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* bytes needed to encode op with operand arg */
+unsigned vm_insn_len(enum vmop op, vmcell arg)
+{
+	if (op_operand(op) <= 0)
+		return 1;
+	return 1 + varint_len(op_is_jump(op) ? zigzag(arg) : arg);
+}
+
+/* append an instruction, padding its operand to fill len bytes if that is
+ * more than it needs. returns 0 if out of memory. */
+int vm_emit(struct vmcode *out, enum vmop op, vmcell arg, unsigned len)
+{
+	unsigned char *p;
+	unsigned min = vm_insn_len(op, arg);
+
+	if (len < min)
+		len = min;
+	if (len > 1 + VARINT_MAX)
+		return 0;
+	if (out->len + len > out->max) {
+		unsigned max = out->max ? out->max * 2 : 256;
+
+		while (max < out->len + len)
+			max *= 2;
+		p = mem_realloc(out->buf, max);
+		if (!p)
+			return 0;
+		out->buf = p;
+		out->max = max;
+	}
+	p = out->buf + out->len;
+	out->len += len;
+	*p++ = op;
+	if (len == 1)
+		return 1;
+	if (op_is_jump(op))
+		arg = zigzag(arg);
+	for (len -= 2; len; len--) {
+		*p++ = (arg & 0x7f) | 0x80;
+		arg >>= 7;
+	}
+	*p = arg;
+	return 1;
+}
+
+/* decode the instruction at pc. returns 0 if it is not a valid instruction. */
+int vm_decode(const unsigned char *code, unsigned code_len, unsigned pc, struct vminsn *insn)
 {
-	TRACE_FMT("pc:%04x\n", vm->pc);
-	return vm->code[vm->pc++];
+	unsigned len = 1, shift = 0;
+	vmcell arg = 0;
+	int has_arg;
+
+	if (pc >= code_len)
+		return 0;
+	has_arg = op_operand(code[pc]);
+	if (has_arg < 0)
+		return 0;
+	if (has_arg) {
+		do {
+			if (pc + len >= code_len || len > VARINT_MAX)
+				return 0;
+			arg |= (vmcell)(code[pc + len] & 0x7f) << shift;
+			shift += 7;
+		} while (code[pc + len++] & 0x80);
+	}
+	insn->op = code[pc];
+	insn->len = len;
+	if (op_is_jump(insn->op))
+		arg = unzigzag(arg);
+	insn->arg = arg;
+	insn->target = pc + len + arg;
+	return 1;
 }
 
-static vmcell vm_pcdata_next(struct vmstate *vm)
+/* vm_decode() for code that passed vm_verify(), which needs no checks.
+ * returns the length of the instruction. */
+static unsigned vm_fetch(const unsigned char *code, unsigned pc, struct vminsn *insn)
 {
-	return vm->code[vm->pc++];
+	unsigned len = 1, shift = 0;
+	vmcell arg = 0;
+
+	insn->op = code[pc];
+	if (op_operand(insn->op)) {
+		do {
+			arg |= (vmcell)(code[pc + len] & 0x7f) << shift;
+			shift += 7;
+		} while (code[pc + len++] & 0x80);
+	}
+	insn->len = len;
+	if (op_is_jump(insn->op))
+		arg = unzigzag(arg);
+	insn->arg = arg;
+	insn->target = pc + len + arg;
+	return len;
 }
 
-static vmcell vm_global(struct vmstate *vm, unsigned i)
+void vm_global_set(struct vmstate *vm, unsigned i, vmcell v)
 {
-	return vm->global[i];
+	if (i < vm->nglobals)
+		vm->global[i] = v;
 }
 
-static void vm_global_set(struct vmstate *vm, unsigned i, vmcell v)
+vmcell vm_result(const struct vmstate *vm)
 {
-	vm->global[i] = v;
+	return vm->result;
+}
+
+/* c ? a : b without a branch to mispredict, compilers tend to turn the
+ * conditional operator back into one */
+static vmcell pick(vmcell c, vmcell a, vmcell b)
+{
+	vmcell mask = -(vmcell)(c != 0);
+
+	return (a & mask) | (b & ~mask);
+}
+
+/* what IADD, ISUB, UMUL and UDIV compute from a and b, for the code that
+ * works out values without running the VM and must agree with it */
+vmcell vm_arith(enum vmop op, vmcell a, vmcell b)
+{
+	switch (op) {
+	case IADD: return a + b;
+	case ISUB: return a - b;
+	case UMUL: return a * b;
+	case UDIV: return b ? a / b : a; /* leaves the dividend alone */
+	default: return 0;
+	}
 }
 
 static void vm_push(struct vmstate *vm, vmcell v)
@@ -64,43 +326,288 @@ static vmcell vm_pop(struct vmstate *vm)
 	return vm->stack[--vm->sp];
 }
 
-struct vmstate *vm_new(const vmcell *code, unsigned code_len)
+/* make sure *p has room for n elements. returns 0 if out of memory. */
+static int grow(void **p, unsigned *max, unsigned n, size_t size)
+{
+	void *tmp;
+
+	if (n <= *max)
+		return 1;
+	tmp = mem_realloc(*p, n * size);
+	if (!tmp)
+		return 0;
+	*p = tmp;
+	*max = n;
+	return 1;
+}
+
+#ifdef VM_THREADED
+/* with load set, translates vm->code into vm->thread and returns 0 on success.
+ * otherwise runs the threaded code. the label addresses only exist inside
+ * this function, so both jobs have to live here. the code has been verified,
+ * so neither does any checking. */
+static int vm_threaded(struct vmstate *vm, int load)
+{
+	static const void *const handler[] = {
+		[HALT] = &&do_halt, [IFETCH] = &&do_ifetch, [ISTORE] = &&do_istore,
+		[IPUSH] = &&do_ipush, [IPOP] = &&do_ipop,
+		[IADD] = &&do_iadd, [ISUB] = &&do_isub,
+		[UMUL] = &&do_umul, [UDIV] = &&do_udiv,
+		[ILT] = &&do_ilt,
+		[JZ] = &&do_jz, [JNZ] = &&do_jnz, [JMP] = &&do_jmp,
+		[IADDI] = &&do_iaddi, [ISUBI] = &&do_isubi,
+		[UMULI] = &&do_umuli, [UDIVI] = &&do_udivi,
+		[IADDG] = &&do_iaddg, [ISUBG] = &&do_isubg,
+		[UMULG] = &&do_umulg, [UDIVG] = &&do_udivg,
+		[IDUP] = &&do_idup, [TALLOC] = &&do_talloc,
+		[TSTORE] = &&do_tstore, [TFETCH] = &&do_tfetch,
+		[SELECT] = &&do_select,
+	};
+	union vmthread *ip;
+	vmcell *sp;
+
+	if (load) {
+		union vmthread *t;
+		unsigned *index, pc, n = 0;
+		struct vminsn insn;
+
+		/* index maps the start of each instruction to its entry */
+		if (!grow((void**)&vm->index, &vm->index_max, vm->code_len, sizeof(*index)))
+			return -1;
+		index = vm->index;
+		for (pc = 0; pc < vm->code_len; pc += insn.len) {
+			vm_fetch(vm->code, pc, &insn);
+			index[pc] = n;
+			n += insn.len > 1 ? 2 : 1;
+		}
+		if (!grow((void**)&vm->thread, &vm->thread_max, n, sizeof(*t)))
+			return -1;
+		t = vm->thread;
+		for (pc = 0; pc < vm->code_len; pc += insn.len) {
+			unsigned i = index[pc];
+
+			vm_fetch(vm->code, pc, &insn);
+			t[i].handler = handler[insn.op];
+			if (op_is_jump(insn.op))
+				t[i + 1].target = &t[index[insn.target]];
+			else if (insn.len > 1)
+				t[i + 1].arg = insn.arg;
+		}
+		vm->threaded = 1;
+		return 0;
+	}
+
+#define NEXT goto *(ip++)->handler
+	ip = vm->thread;
+	sp = vm->stack;
+	NEXT;
+
+do_halt:
+	vm->result = sp[-1];
+	vm->sp = sp - vm->stack;
+	vm->pc = ip - vm->thread;
+	return 0;
+do_ifetch:
+	*sp++ = vm->global[(ip++)->arg];
+	NEXT;
+do_istore:
+	vm->global[(ip++)->arg] = *--sp;
+	NEXT;
+do_ipush:
+	*sp++ = (ip++)->arg;
+	NEXT;
+do_ipop:
+	sp--;
+	NEXT;
+do_iadd:
+	sp--;
+	sp[-1] += sp[0];
+	NEXT;
+do_isub:
+	sp--;
+	sp[-1] -= sp[0];
+	NEXT;
+do_umul:
+	sp--;
+	sp[-1] *= sp[0];
+	NEXT;
+do_udiv:
+	sp--;
+	if (sp[0])
+		sp[-1] /= sp[0];
+	NEXT;
+do_ilt:
+	sp--;
+	sp[-1] = sp[-1] < sp[0];
+	NEXT;
+do_iaddi:
+	sp[-1] += (ip++)->arg;
+	NEXT;
+do_isubi:
+	sp[-1] -= (ip++)->arg;
+	NEXT;
+do_umuli:
+	sp[-1] *= (ip++)->arg;
+	NEXT;
+do_udivi:
+	if (ip->arg)
+		sp[-1] /= ip->arg;
+	ip++;
+	NEXT;
+do_iaddg:
+	sp[-1] += vm->global[(ip++)->arg];
+	NEXT;
+do_isubg:
+	sp[-1] -= vm->global[(ip++)->arg];
+	NEXT;
+do_umulg:
+	sp[-1] *= vm->global[(ip++)->arg];
+	NEXT;
+do_udivg: {
+	vmcell d = vm->global[(ip++)->arg];
+
+	if (d)
+		sp[-1] /= d;
+	NEXT;
+}
+do_idup:
+	sp[0] = sp[-1];
+	sp++;
+	NEXT;
+do_talloc:
+	memset(sp, 0, sizeof(*sp) * ip->arg);
+	sp += (ip++)->arg;
+	NEXT;
+do_tstore:
+	vm->stack[(ip++)->arg] = sp[-1];
+	NEXT;
+do_tfetch:
+	*sp++ = vm->stack[(ip++)->arg];
+	NEXT;
+do_select:
+	sp -= 2;
+	sp[-1] = pick(sp[-1], sp[0], sp[1]);
+	NEXT;
+do_jz:
+	ip = *--sp ? ip + 1 : ip->target;
+	NEXT;
+do_jnz:
+	ip = *--sp ? ip->target : ip + 1;
+	NEXT;
+do_jmp:
+	ip = ip->target;
+	NEXT;
+#undef NEXT
+}
+#endif
+
+/* nglobals is the number of global slots. returns NULL if out of memory or if
+ * the code does not pass vm_verify(). */
+struct vmstate *vm_new(const unsigned char *code, unsigned code_len, unsigned nglobals)
 {
 	struct vmstate *st;
 
-	st = calloc(1, sizeof(*st));
-	st->code = code; /* WARNING: code pointer must be preserved until vm_free() */
-	st->code_len = code_len;
+	st = mem_calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	if (vm_load(st, code, code_len, nglobals)) {
+		vm_free(st);
+		return NULL;
+	}
 	return st;
 }
 
+/* replace the program, reusing the memory of the previous one. the globals
+ * are cleared. empty code loads but does not run. returns 0 on success, -1 if
+ * out of memory or if the code does not pass vm_verify(), which leaves
+ * nothing loaded. */
+int vm_load(struct vmstate *vm, const unsigned char *code, unsigned code_len, unsigned nglobals)
+{
+	int depth = code_len ? vm_verify(code, code_len, nglobals, NULL) : 0;
+
+	vm->code = NULL;
+	vm->code_len = 0;
+	vm->threaded = 0;
+	if (depth < 0)
+		return -1;
+	if (!grow((void**)&vm->global, &vm->global_max, nglobals ? nglobals : 1, sizeof(*vm->global))
+		|| !grow((void**)&vm->stack, &vm->stack_max, depth ? depth : 1, sizeof(*vm->stack)))
+		return -1;
+	memset(vm->global, 0, sizeof(*vm->global) * nglobals);
+	vm->nglobals = nglobals;
+	vm->code = code; /* WARNING: code pointer must be preserved until vm_free() */
+	vm->code_len = code_len;
+#ifdef VM_THREADED
+	if (code_len)
+		vm_threaded(vm, 1); /* if out of memory vm_run() uses the switch loop */
+#endif
+	return 0;
+}
+
+void vm_code_free(struct vmcode *code)
+{
+	mem_free(code->buf);
+	mem_free(code->lines);
+	memset(code, 0, sizeof(*code));
+}
+
+/* the source position of the instruction at pc, or NULL if unknown. */
+const struct vmline *vm_code_line(const struct vmcode *code, unsigned pc)
+{
+	unsigned lo = 0, hi = code->nlines;
+
+	/* find the last entry at or before pc */
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (code->lines[mid].pc <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &code->lines[lo - 1] : NULL;
+}
+
 void vm_free(struct vmstate *vm)
 {
-	free(vm);
+	if (!vm)
+		return;
+	mem_free(vm->thread);
+	mem_free(vm->index);
+	mem_free(vm->stack);
+	mem_free(vm->global);
+	mem_free(vm);
 }
 
-int vm_run(struct vmstate *vm)
+/* portable interpreter, also used when the code could not be threaded. it
+ * does the counting too: by opcode into count, and by pc into prof. either
+ * may be NULL. the code has been verified, nothing is checked here. */
+static int vm_switch(struct vmstate *vm, unsigned long *count, struct vmprofile *prof)
 {
+	struct vminsn insn;
+	unsigned pc;
+
 	TRACE;
 	while (1) {
-		if (vm->pc >= vm->code_len) {
-			fprintf(stderr, "VM jumped out of bounds\n");
-			return -1;
-		}
-		TRACE_FMT("\t\t%02X\n", vm->code[vm->pc]);
-		switch (vm_next(vm)) {
+		pc = vm->pc;
+		vm->pc += vm_fetch(vm->code, pc, &insn);
+		TRACE_FMT("pc:%04x\t\t%02X\n", pc, insn.op);
+		if (count)
+			count[insn.op]++;
+		if (prof)
+			prof->count[pc]++;
+		switch (insn.op) {
 		case HALT:
-			// TODO: check for stack overflow
-			printf("result = %d\n", vm->stack[vm->sp - 1]);
+			vm->result = vm->stack[vm->sp - 1];
 			return 0;
 		case IFETCH:
-			vm_push(vm, vm_global(vm, vm_pcdata_next(vm)));
+			vm_push(vm, vm->global[insn.arg]);
 			break;
 		case ISTORE:
-			vm_global_set(vm, vm_pcdata_next(vm), vm_pop(vm));
+			vm->global[insn.arg] = vm_pop(vm);
 			break;
 		case IPUSH:
-			vm_push(vm, vm_pcdata_next(vm));
+			vm_push(vm, insn.arg);
 			break;
 		case IPOP: /* TODO: rename this DROP */
 			vm_pop(vm);
@@ -131,43 +638,249 @@ int vm_run(struct vmstate *vm)
 			vm->stack[vm->sp - 1] =
 				vm->stack[vm->sp - 1] < vm->stack[vm->sp];
 			break;
-		case JZ: { /* Jump if zero */
-			vmcell ofs = vm_pcdata_next(vm) - 1;
-			TRACE_FMT("JZ %+d\n", ofs);
+		case JZ: /* Jump if zero */
+			TRACE_FMT("JZ %+d\n", insn.arg);
 			if (!vm_pop(vm)) {
-				vm->pc += ofs;
+				vm->pc = insn.target;
+				if (prof)
+					prof->taken[pc]++;
 				TRACE_FMT("\tjump to PC=%04x\n", vm->pc);
 			}
 			break;
-		}
-		case JNZ: { /* Jump if not zero */
-			vmcell ofs = vm_pcdata_next(vm) - 1;
-
-			TRACE_FMT("JNZ %+d\n", ofs);
+		case JNZ: /* Jump if not zero */
+			TRACE_FMT("JNZ %+d\n", insn.arg);
 			if (vm_pop(vm)) {
-				vm->pc += ofs;
+				vm->pc = insn.target;
+				if (prof)
+					prof->taken[pc]++;
 				TRACE_FMT("\tjump to PC=%04x\n", vm->pc);
 			}
 			break;
-		}
-		case JMP: { /* relative jump */
-			vmcell ofs = vm_pcdata_next(vm) - 1;
-
-			TRACE_FMT("JMP %+d\n", ofs);
-			vm->pc += ofs;
+		case JMP: /* relative jump */
+			TRACE_FMT("JMP %+d\n", insn.arg);
+			vm->pc = insn.target;
+			if (prof)
+				prof->taken[pc]++;
 			TRACE_FMT("\tjump to PC=%04x\n", vm->pc);
 			break;
+		case IADDI:
+			vm->stack[vm->sp - 1] += insn.arg;
+			break;
+		case ISUBI:
+			vm->stack[vm->sp - 1] -= insn.arg;
+			break;
+		case UMULI:
+			vm->stack[vm->sp - 1] *= insn.arg;
+			break;
+		case UDIVI:
+			if (insn.arg)
+				vm->stack[vm->sp - 1] /= insn.arg;
+			break;
+		case IADDG:
+			vm->stack[vm->sp - 1] += vm->global[insn.arg];
+			break;
+		case ISUBG:
+			vm->stack[vm->sp - 1] -= vm->global[insn.arg];
+			break;
+		case UMULG:
+			vm->stack[vm->sp - 1] *= vm->global[insn.arg];
+			break;
+		case UDIVG: {
+			vmcell d = vm->global[insn.arg];
+
+			if (d)
+				vm->stack[vm->sp - 1] /= d;
+			break;
+		}
+		case IDUP:
+			vm_push(vm, vm->stack[vm->sp - 1]);
+			break;
+		case TALLOC:
+			memset(vm->stack + vm->sp, 0, sizeof(*vm->stack) * insn.arg);
+			vm->sp += insn.arg;
+			break;
+		case TSTORE:
+			vm->stack[insn.arg] = vm->stack[vm->sp - 1];
+			break;
+		case TFETCH:
+			vm_push(vm, vm->stack[insn.arg]);
+			break;
+		case SELECT:
+			vm->sp -= 2;
+			vm->stack[vm->sp - 1] = pick(vm->stack[vm->sp - 1],
+				vm->stack[vm->sp], vm->stack[vm->sp + 1]);
+			break;
 		}
+	}
+}
+
+/* with stats on, the counting switch loop is used instead of the threaded
+ * code, which keeps the threaded handlers free of any checks. */
+static int vm_run_stats(struct vmstate *vm)
+{
+	unsigned long count[VM_OP_COUNT] = { 0 }, total = 0;
+	unsigned long long start = stats_clock();
+	unsigned i;
+	int ret;
+
+	ret = vm_switch(vm, count, vm->prof);
+	for (i = 0; i < VM_OP_COUNT; i++) {
+		if (count[i])
+			STATS_ADD(ops[i], count[i]);
+		total += count[i];
+	}
+	STATS_ADD(insns, total);
+	stats_phase(PHASE_RUN, start);
+	return ret;
+}
+
+/* runs the program from the start, globals keep their values. returns 0 on
+ * success, -1 if no program is loaded. */
+int vm_run(struct vmstate *vm)
+{
+	if (!vm->code_len)
+		return -1;
+	vm->pc = 0;
+	vm->sp = 0;
+	if (stats_enabled)
+		return vm_run_stats(vm);
+#ifdef VM_THREADED
+	if (vm->threaded && !vm->prof)
+		return vm_threaded(vm, 0);
+#endif
+	return vm_switch(vm, NULL, vm->prof);
+}
+
+/* runs code once without a vmstate of its own and returns the result. the
+ * code must have passed vm_verify() and stack must have room for as many
+ * cells as it returned. nothing is allocated and the code is only read, so
+ * threads may share it as long as each passes its own globals and stack. */
+vmcell vm_exec(const unsigned char *code, unsigned code_len, vmcell *global, vmcell *stack)
+{
+	struct vmstate vm = {
+		.global = global,
+		.code = code, .code_len = code_len,
+		.stack = stack,
+	};
+
+	vm_switch(&vm, NULL, NULL);
+	return vm.result;
+}
+
+/* count every instruction vm_run() executes into prof, whose arrays must have
+ * an entry for each byte of code. NULL stops profiling. */
+void vm_profile(struct vmstate *vm, struct vmprofile *prof)
+{
+	vm->prof = prof;
+}
+
+/* checks that code is safe to run without any checks: every instruction
+ * decodes, uses a global below nglobals and jumps to the start of an
+ * instruction, reached or not, none that is reached takes the stack below
+ * empty or past VM_STACK_MAX, and every path to an instruction reaches it
+ * with the same depth. returns the deepest the stack gets, or -1 if the code
+ * is not safe. if depth is not NULL it gets an entry for each byte of code:
+ * the stack depth on entry to the instruction starting there, or -1 if none
+ * starts there or it is never reached. */
+int vm_verify(const unsigned char *code, unsigned code_len, unsigned nglobals, int *depth)
+{
+	int *dep, max = -1;
+	unsigned *work = NULL, top = 0, pc;
+	struct vminsn insn;
+
+	if (!code_len)
+		return -1;
+	dep = depth ? depth : mem_alloc(sizeof(*dep) * code_len);
+	if (!dep)
+		return -1;
+
+	/* mark where instructions start, -2 is inside one */
+	for (pc = 0; pc < code_len; pc += insn.len) {
+		if (!vm_decode(code, code_len, pc, &insn))
+			goto out;
+		if (op_is_global(insn.op) && insn.arg >= nglobals)
+			goto out;
+		dep[pc] = -1;
+		memset(dep + pc + 1, 0xfe, sizeof(*dep) * (insn.len - 1));
+	}
+	/* the threaded code and batch translate unreachable jumps too */
+	for (pc = 0; pc < code_len; pc += insn.len) {
+		vm_fetch(code, pc, &insn);
+		if (op_is_jump(insn.op) && (insn.target >= code_len || dep[insn.target] != -1))
+			goto out;
+	}
+
+	work = mem_alloc(sizeof(*work) * code_len);
+	if (!work)
+		goto out;
+	dep[0] = 0;
+	work[top++] = 0;
+	max = 0;
+	while (top) {
+		unsigned next[2];
+		int d, i, n = 0;
+
+		pc = work[--top];
+		d = dep[pc];
+		vm_fetch(code, pc, &insn);
+		if (d < op_pops(insn.op))
+			goto fail; /* underflow */
+		if ((insn.op == TSTORE || insn.op == TFETCH) && insn.arg >= (unsigned)d)
+			goto fail; /* not a cell below the top */
+		if (insn.op == TALLOC && insn.arg > (unsigned)(VM_STACK_MAX - d))
+			goto fail;
+		d += op_pushes(insn.op) - op_pops(insn.op);
+		if (insn.op == TALLOC)
+			d += insn.arg;
+		if (d > VM_STACK_MAX)
+			goto fail;
+		if (d > max)
+			max = d;
+		if (op_is_jump(insn.op))
+			next[n++] = insn.target;
+		if (insn.op != JMP && insn.op != HALT)
+			next[n++] = pc + insn.len;
+		for (i = 0; i < n; i++) {
+			if (next[i] >= code_len || dep[next[i]] < -1)
+				goto fail;
+			if (dep[next[i]] == -1) {
+				dep[next[i]] = d;
+				work[top++] = next[i];
+			} else if (dep[next[i]] != d) {
+				goto fail;
+			}
+		}
+	}
+	goto out;
+fail:
+	max = -1;
+out:
+	if (depth) {
+		for (pc = 0; pc < code_len; pc++) {
+			if (dep[pc] < -1)
+				dep[pc] = -1;
 		}
 	}
+	mem_free(work);
+	if (!depth)
+		mem_free(dep);
+	return max;
 }
 
 void vm_dump(struct vmstate *vm)
 {
-	unsigned i;
+	struct vminsn insn;
+	unsigned pc;
 
 	printf("code_len=%d\n", vm->code_len);
-	for (i = 0; i < vm->code_len; i++) {
-		printf("%04x %02x\n", i, vm->code[i]);
+	for (pc = 0; pc < vm->code_len; pc += insn.len) {
+		if (!vm_decode(vm->code, vm->code_len, pc, &insn)) {
+			printf("%04x ?? %02x\n", pc, vm->code[pc]);
+			break;
+		}
+		if (insn.len > 1)
+			printf("%04x %02x %u\n", pc, insn.op, insn.arg);
+		else
+			printf("%04x %02x\n", pc, insn.op);
 	}
-}
\ No newline at end of file
+}
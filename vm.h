@@ -2,18 +2,75 @@
 #define VM_H
 typedef unsigned vmcell;
 
+#define VM_STACK_MAX (1 << 16) /* most stack cells a program may use */
+
 enum vmop {
 	HALT, IFETCH, ISTORE, IPUSH, IPOP,
 	IADD, ISUB, UMUL, UDIV,
 	ILT,
 	JZ, JNZ, JMP,
+	/* superinstructions, the right operand is an immediate or a global */
+	IADDI, ISUBI, UMULI, UDIVI,
+	IADDG, ISUBG, UMULG, UDIVG,
+	/* values computed once and reused, temps live at the bottom of the stack */
+	IDUP, TALLOC, TSTORE, TFETCH,
+	/* pops a condition and two values, pushes the first if the condition is
+	 * not zero and the second if it is */
+	SELECT,
+};
+
+#define VM_OP_COUNT (SELECT + 1)
+
+/* one decoded instruction */
+struct vminsn {
+	enum vmop op;
+	unsigned len; /* bytes used by the instruction */
+	vmcell arg; /* immediate value, global slot or relative jump */
+	unsigned target; /* absolute destination of a jump */
+};
 
+/* source position of the instructions from pc up to the next entry */
+struct vmline {
+	unsigned pc;
+	unsigned line;
+	unsigned ofs;
+};
+
+/* growable buffer of encoded instructions */
+struct vmcode {
+	unsigned char *buf;
+	unsigned len;
+	unsigned max;
+	unsigned nglobals; /* global slots the program needs */
+	struct vmline *lines; /* sorted by pc, may be empty */
+	unsigned nlines;
+	unsigned lines_max;
+};
+
+/* execution counts, indexed by the pc of each instruction */
+struct vmprofile {
+	unsigned long *count;
+	unsigned long *taken; /* jumps only */
 };
 
 struct vmstate;
 
-struct vmstate *vm_new(const vmcell *code, unsigned code_len);
+const char *vm_op_name(enum vmop op);
+int vm_decode(const unsigned char *code, unsigned code_len, unsigned pc, struct vminsn *insn);
+unsigned vm_insn_len(enum vmop op, vmcell arg);
+int vm_emit(struct vmcode *out, enum vmop op, vmcell arg, unsigned len);
+
+struct vmstate *vm_new(const unsigned char *code, unsigned code_len, unsigned nglobals);
+int vm_load(struct vmstate *vm, const unsigned char *code, unsigned code_len, unsigned nglobals);
 void vm_free(struct vmstate *vm);
+void vm_code_free(struct vmcode *code);
+const struct vmline *vm_code_line(const struct vmcode *code, unsigned pc);
+void vm_profile(struct vmstate *vm, struct vmprofile *prof);
 int vm_run(struct vmstate *vm);
+vmcell vm_exec(const unsigned char *code, unsigned code_len, vmcell *global, vmcell *stack);
+vmcell vm_result(const struct vmstate *vm);
+void vm_global_set(struct vmstate *vm, unsigned i, vmcell v);
+int vm_verify(const unsigned char *code, unsigned code_len, unsigned nglobals, int *depth);
+vmcell vm_arith(enum vmop op, vmcell a, vmcell b);
 void vm_dump(struct vmstate *vm);
 #endif